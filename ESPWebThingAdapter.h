@@ -16,14 +16,31 @@
 #include <ArduinoJson.h>
 #include <ESPAsyncWebServer.h>
 
+#ifndef WITHOUT_MDNS
 #ifdef ESP8266
 #include <ESP8266mDNS.h>
 #else
 #include <ESPmDNS.h>
 #endif
+#endif
 #include "Thing.h"
 
+// Largest request body that is accepted, larger ones get a 413 response
+#ifndef ESP_MAX_PUT_BODY_SIZE
 #define ESP_MAX_PUT_BODY_SIZE 512
+#endif
+
+#ifndef LONG_POLL_MAX_REQUESTS
+#define LONG_POLL_MAX_REQUESTS 4
+#endif
+
+#ifndef LONG_POLL_DEFAULT_TIMEOUT
+#define LONG_POLL_DEFAULT_TIMEOUT 10000
+#endif
+
+#ifndef LONG_POLL_MAX_TIMEOUT
+#define LONG_POLL_MAX_TIMEOUT 30000
+#endif
 
 #ifndef LARGE_JSON_DOCUMENT_SIZE
 #ifdef LARGE_JSON_BUFFERS
@@ -43,33 +60,44 @@
 
 class WebThingAdapter {
 public:
-  WebThingAdapter(String _name, IPAddress _ip, uint16_t _port = 80,
+  WebThingAdapter(const String &_name, IPAddress _ip, uint16_t _port = 80,
                   bool _disableHostValidation = false)
       : server(_port), name(_name), ip(_ip.toString()), port(_port),
         disableHostValidation(_disableHostValidation) {}
 
   void begin() {
+#ifdef WITH_JSON_POOL
+    thingJsonPool();
+#endif
     name.toLowerCase();
+#ifndef WITHOUT_MDNS
     if (MDNS.begin(this->name.c_str())) {
-      Serial.println("MDNS responder started");
+      Serial.println(F("MDNS responder started"));
     }
 
     MDNS.addService("webthing", "tcp", port);
     MDNS.addServiceTxt("webthing", "tcp", "path", "/");
+#endif
 
+#ifndef WITHOUT_CORS
     DefaultHeaders::Instance().addHeader("Access-Control-Allow-Origin", "*");
     DefaultHeaders::Instance().addHeader("Access-Control-Allow-Methods",
                                          "GET, POST, PUT, DELETE, OPTIONS");
     DefaultHeaders::Instance().addHeader(
         "Access-Control-Allow-Headers",
         "Origin, X-Requested-With, Content-Type, Accept");
+    DefaultHeaders::Instance().addHeader("Access-Control-Expose-Headers",
+                                         "X-Thing-Version");
+#endif
 
     this->server.onNotFound(std::bind(&WebThingAdapter::handleUnknown, this,
                                       std::placeholders::_1));
 
+#ifndef WITHOUT_CORS
     this->server.on("/*", HTTP_OPTIONS,
                     std::bind(&WebThingAdapter::handleOptions, this,
                               std::placeholders::_1));
+#endif
     this->server.on("/", HTTP_GET,
                     std::bind(&WebThingAdapter::handleThings, this,
                               std::placeholders::_1));
@@ -83,7 +111,8 @@ public:
         String propertyBase = deviceBase + "/properties/" + property->id;
         this->server.on(propertyBase.c_str(), HTTP_GET,
                         std::bind(&WebThingAdapter::handleThingPropertyGet,
-                                  this, std::placeholders::_1, property));
+                                  this, std::placeholders::_1, device,
+                                  property));
         this->server.on(propertyBase.c_str(), HTTP_PUT,
                         std::bind(&WebThingAdapter::handleThingPropertyPut,
                                   this, std::placeholders::_1, device,
@@ -97,6 +126,7 @@ public:
         property = (ThingProperty *)property->next;
       }
 
+#ifndef WITHOUT_ACTIONS
       ThingAction *action = device->firstAction;
       while (action != nullptr) {
         String actionBase = deviceBase + "/actions/" + action->id;
@@ -117,7 +147,9 @@ public:
                                   action));
         action = (ThingAction *)action->next;
       }
+#endif
 
+#ifndef WITHOUT_EVENTS
       ThingEvent *event = device->firstEvent;
       while (event != nullptr) {
         String eventBase = deviceBase + "/events/" + event->id;
@@ -126,25 +158,43 @@ public:
                                   std::placeholders::_1, device, event));
         event = (ThingEvent *)event->next;
       }
+#endif
 
       this->server.on((deviceBase + "/properties").c_str(), HTTP_GET,
                       std::bind(&WebThingAdapter::handleThingPropertiesGet,
-                                this, std::placeholders::_1,
-                                device->firstProperty));
-      this->server.on((deviceBase + "/actions").c_str(), HTTP_GET,
-                      std::bind(&WebThingAdapter::handleThingActionsGet, this,
-                                std::placeholders::_1, device));
-      this->server.on((deviceBase + "/actions").c_str(), HTTP_POST,
-                      std::bind(&WebThingAdapter::handleThingActionsPost, this,
-                                std::placeholders::_1, device),
+                                this, std::placeholders::_1, device));
+      this->server.on((deviceBase + "/properties").c_str(), HTTP_PUT,
+                      std::bind(&WebThingAdapter::handleThingPropertiesPut,
+                                this, std::placeholders::_1, device),
                       NULL,
                       std::bind(&WebThingAdapter::handleBody, this,
                                 std::placeholders::_1, std::placeholders::_2,
                                 std::placeholders::_3, std::placeholders::_4,
                                 std::placeholders::_5));
-      this->server.on((deviceBase + "/events").c_str(), HTTP_GET,
-                      std::bind(&WebThingAdapter::handleThingEventsGet, this,
-                                std::placeholders::_1, device));
+#ifndef WITHOUT_ACTIONS
+      if (device->firstAction != nullptr) {
+        this->server.on(
+            (deviceBase + "/actions").c_str(), HTTP_GET,
+            std::bind(&WebThingAdapter::handleThingActionsGet, this,
+                      std::placeholders::_1, device));
+        this->server.on(
+            (deviceBase + "/actions").c_str(), HTTP_POST,
+            std::bind(&WebThingAdapter::handleThingActionsPost, this,
+                      std::placeholders::_1, device),
+            NULL,
+            std::bind(&WebThingAdapter::handleBody, this,
+                      std::placeholders::_1, std::placeholders::_2,
+                      std::placeholders::_3, std::placeholders::_4,
+                      std::placeholders::_5));
+      }
+#endif
+#ifndef WITHOUT_EVENTS
+      if (device->firstEvent != nullptr) {
+        this->server.on((deviceBase + "/events").c_str(), HTTP_GET,
+                        std::bind(&WebThingAdapter::handleThingEventsGet, this,
+                                  std::placeholders::_1, device));
+      }
+#endif
       this->server.on(deviceBase.c_str(), HTTP_GET,
                       std::bind(&WebThingAdapter::handleThing, this,
                                 std::placeholders::_1, device));
@@ -152,25 +202,51 @@ public:
       device = device->next;
     }
 
+#ifdef WITH_WS_MULTIPLEX
+    mux.ws = new AsyncWebSocket(WS_MULTIPLEX_PATH);
+    mux.ws->onEvent(std::bind(
+        &WebThingAdapter::handleMultiplexWS, this, std::placeholders::_1,
+        std::placeholders::_2, std::placeholders::_3, std::placeholders::_4,
+        std::placeholders::_5, std::placeholders::_6));
+    this->server.addHandler(mux.ws);
+#endif
+
     this->server.begin();
   }
 
   void update() {
-#ifdef ESP8266
+#if defined(ESP8266) && !defined(WITHOUT_MDNS)
     MDNS.update();
 #endif
+    runCallbacks();
+    answerPendingReads();
+    updateWatchers();
 #ifndef WITHOUT_WS
+#ifdef WITH_WS_MULTIPLEX
+    updateMultiplexLagging();
+#endif
     // * Send changed properties as defined in "4.5 propertyStatus message"
     // Do this by looping over all devices and properties
     ThingDevice *device = this->firstDevice;
     while (device != nullptr) {
       sendChangedProperties(device);
+      device->flushMessages();
+      device = device->next;
+    }
+#ifdef WITH_WS_MULTIPLEX
+    mux.flush();
+#endif
+#elif defined(WITH_SSE)
+    ThingDevice *device = this->firstDevice;
+    while (device != nullptr) {
+      device->publishChangedProperties();
       device = device->next;
     }
 #endif
   }
 
   void addDevice(ThingDevice *device) {
+    device->setAddress(ip, port);
     if (this->lastDevice == nullptr) {
       this->firstDevice = device;
       this->lastDevice = device;
@@ -190,6 +266,18 @@ public:
         std::placeholders::_2, std::placeholders::_3, std::placeholders::_4,
         std::placeholders::_5, std::placeholders::_6, device));
     this->server.addHandler(ws);
+#endif
+#ifdef WITH_WS_MULTIPLEX
+    device->mux = &mux;
+#endif
+
+#ifdef WITH_SSE
+    AsyncEventSource *sse =
+        new AsyncEventSource("/things/" + device->id + "/stream");
+    device->sse = sse;
+    sse->onConnect(std::bind(&WebThingAdapter::handleStreamConnect, this,
+                             std::placeholders::_1, device));
+    this->server.addHandler(sse);
 #endif
   }
 
@@ -202,10 +290,92 @@ private:
   bool disableHostValidation;
   ThingDevice *firstDevice = nullptr;
   ThingDevice *lastDevice = nullptr;
-  char body_data[ESP_MAX_PUT_BODY_SIZE];
-  bool b_has_body_data = false;
+#ifdef WITH_WS_MULTIPLEX
+  ThingMultiplexSocket mux;
+#endif
+
+  /**
+   * A property read waiting for a value to change after version waitFor, or
+   * with sampling for update() to sample a stale value, or for its deadline
+   * to pass.
+   */
+  struct PendingRead {
+    // Null while the slot is free
+    ThingDevice *device = nullptr;
+    ThingItem *item = nullptr;
+    uint32_t waitFor = 0;
+    long since = -1;
+    unsigned long deadline = 0;
+    bool sampling = false;
+    // Value of samplePasses when the read was parked
+    uint32_t parkedPass = 0;
+    // Set by update() once the read can be answered
+    bool ready = false;
+  };
+  PendingRead pendingReads[LONG_POLL_MAX_REQUESTS];
+  // Counts the calls to answerPendingReads(), each after sampling
+  uint32_t samplePasses = 0;
+  // Slots are claimed and released on the network task, update() only marks
+  // them ready
+  ThingLock pendingLock = THING_LOCK_INITIALIZER;
+
+  /**
+   * Response to a parked read. The server polls it on the network task and
+   * it is only written once update() marked its slot ready, so that update()
+   * never touches a request the server may free when the client goes away.
+   */
+  class ParkedResponse : public AsyncResponseStream {
+  public:
+    ParkedResponse(WebThingAdapter *adapter, PendingRead *slot)
+        : AsyncResponseStream("application/json", 1460), adapter(adapter),
+          slot(slot) {}
+
+    ~ParkedResponse() {
+      if (slot != nullptr) {
+        adapter->releaseRead(slot);
+      }
+    }
+
+    void _respond(AsyncWebServerRequest *request) override {
+      _ack(request, 0, 0);
+    }
+
+    size_t _ack(AsyncWebServerRequest *request, size_t len,
+                uint32_t time) override {
+      if (slot == nullptr) {
+        return AsyncResponseStream::_ack(request, len, time);
+      }
+      if (!adapter->isReadReady(slot)) {
+        return 0;
+      }
+      adapter->writePropertyValues(this, slot->device, slot->item,
+                                   slot->since);
+      adapter->releaseRead(slot);
+      slot = nullptr;
+      AsyncResponseStream::_respond(request);
+      return 0;
+    }
+
+  private:
+    WebThingAdapter *adapter;
+    PendingRead *slot;
+  };
+
+  ThingDevice *findDevice(const char *id) {
+    ThingDevice *device = this->firstDevice;
+    while (device != nullptr) {
+      if (!strcmp(device->id.c_str(), id)) {
+        return device;
+      }
+      device = device->next;
+    }
+    return nullptr;
+  }
 
   bool verifyHost(AsyncWebServerRequest *request) {
+#ifdef WITHOUT_HOST_VALIDATION
+    return true;
+#else
     if (disableHostValidation) {
       return true;
     }
@@ -226,6 +396,7 @@ private:
     }
     request->send(403);
     return false;
+#endif
   }
 
 #ifndef WITHOUT_WS
@@ -239,40 +410,186 @@ private:
   }
 
   void handleWS(AsyncWebSocket *server, AsyncWebSocketClient *client,
-                AwsEventType type, void *arg, const uint8_t *rawData,
+                AwsEventType type, void *arg, uint8_t *rawData,
                 size_t len, ThingDevice *device) {
+    (void)server;
+    if (type == WS_EVT_CONNECT) {
+      if (!device->addClient(client->id())) {
+        client->close(1013, "Too many clients");
+      }
+      return;
+    }
+
     if (type == WS_EVT_DISCONNECT || type == WS_EVT_ERROR) {
-      device->removeEventSubscriptions(client->id());
+      device->removeClient(client->id());
       return;
     }
 
+    if (!isTextMessage(type, arg, len)) {
+      return;
+    }
+
+    // Parse request
+    ThingJsonLease newPropLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &newProp = *newPropLease;
+    auto error = parseMessage(newProp, rawData, len);
+    if (error) {
+      sendErrorMsg(newProp, *client, 400, "Invalid json");
+      return;
+    }
+
+    handleMessage(newProp, client, device, -1);
+  }
+
+  /**
+   * Parses a WebSocket message in place, keeping only the members that
+   * handleMessage() looks at. The document refers to rawData, which is only
+   * valid during the event callback.
+   */
+  DeserializationError parseMessage(JsonDocument &doc, uint8_t *rawData,
+                                    size_t len) {
+    StaticJsonDocument<JSON_OBJECT_SIZE(3)> filter;
+    filter["messageType"] = true;
+    filter["data"] = true;
+    filter["id"] = true;
+    return deserializeJson(doc, (char *)rawData, len,
+                           DeserializationOption::Filter(filter));
+  }
+
+  bool isTextMessage(AwsEventType type, void *arg, size_t len) {
     // Ignore all others except data packets
     if (type != WS_EVT_DATA)
-      return;
+      return false;
 
     // Only consider non fragmented data
     AwsFrameInfo *info = (AwsFrameInfo *)arg;
     if (!info->final || info->index != 0 || info->len != len)
-      return;
+      return false;
 
     // Web Thing only specifies text, not binary websocket transfers
-    if (info->opcode != WS_TEXT)
+    return info->opcode == WS_TEXT;
+  }
+
+#ifdef WITH_WS_MULTIPLEX
+  /**
+   * Handles the adapter-wide socket. Messages are the same as on the
+   * per-thing sockets with an additional "id" member naming the thing.
+   */
+  void handleMultiplexWS(AsyncWebSocket *server, AsyncWebSocketClient *client,
+                         AwsEventType type, void *arg, uint8_t *rawData,
+                         size_t len) {
+    (void)server;
+    if (type == WS_EVT_CONNECT) {
+      if (mux.clients.attach(client->id()) < 0) {
+        client->close(1013, "Too many clients");
+      }
+      return;
+    }
+
+    if (type == WS_EVT_DISCONNECT || type == WS_EVT_ERROR) {
+      removeMultiplexClient(client->id());
       return;
+    }
 
-    // In theory we could just have one websocket for all Things and react on
-    // the server->url() to route data. Controllers will however establish a
-    // separate websocket connection for each Thing anyway as of in the spec.
-    // For now each Thing stores its own Websocket connection object therefore.
+    if (!isTextMessage(type, arg, len)) {
+      return;
+    }
 
-    // Parse request
-    DynamicJsonDocument newProp(SMALL_JSON_DOCUMENT_SIZE);
-    auto error = deserializeJson(newProp, rawData, len);
+    ThingJsonLease newPropLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &newProp = *newPropLease;
+    auto error = parseMessage(newProp, rawData, len);
     if (error) {
       sendErrorMsg(newProp, *client, 400, "Invalid json");
       return;
     }
 
-    String messageType = newProp["messageType"].as<String>();
+    ThingDevice *device = findDevice(newProp["id"] | "");
+    if (device == nullptr) {
+      sendErrorMsg(newProp, *client, 404, "Unknown thing");
+      return;
+    }
+
+    int slot = mux.clients.find(client->id());
+    if (slot < 0) {
+      sendErrorMsg(newProp, *client, 503, "Too many clients");
+      return;
+    }
+
+    handleMessage(newProp, client, device, slot);
+  }
+
+  void removeMultiplexClient(uint32_t id) {
+    int slot = mux.clients.find(id);
+    if (slot < 0) {
+      return;
+    }
+
+    mux.clients.detach(slot);
+    mux.outbox.clear(slot);
+    ThingDevice *device = this->firstDevice;
+    while (device != nullptr) {
+      ThingEvent *event = device->firstEvent;
+      while (event != nullptr) {
+        event->muxSubscribers &= ~thingClientBit(slot);
+        event = (ThingEvent *)event->next;
+      }
+      device = device->next;
+    }
+  }
+
+  /**
+   * Multiplexed clients that fell behind skip property updates and get a
+   * snapshot of every thing's properties once they catch up.
+   */
+  void updateMultiplexLagging() {
+    for (int slot = 0; slot < WS_MAX_CLIENTS; slot++) {
+      uint32_t id;
+      if (!mux.clients.idOf(slot, &id)) {
+        continue;
+      }
+
+      AsyncWebSocketClient *client = mux.ws->client(id);
+      if (client == nullptr) {
+        continue;
+      }
+
+      bool isLagging = client->queueLen() >= WS_CLIENT_QUEUE_SOFT_LIMIT;
+      if (mux.clients.setLagging(slot, isLagging)) {
+        queuePropertySnapshot(slot);
+      }
+    }
+  }
+
+  void queuePropertySnapshot(int slot) {
+    ThingDevice *device = this->firstDevice;
+    while (device != nullptr) {
+      ThingJsonLease messageLease(LARGE_JSON_DOCUMENT_SIZE);
+      DynamicJsonDocument &message = *messageLease;
+      message["id"] = device->id.c_str();
+      message["messageType"] = "propertyStatus";
+      JsonObject prop = message.createNestedObject("data");
+      ThingItem *item = device->firstProperty;
+      while (item != nullptr) {
+        item->serializeValue(prop);
+        item = item->next;
+      }
+      String jsonStr;
+      serializeJson(message, jsonStr);
+      mux.queue(slot, jsonStr);
+      device = device->next;
+    }
+  }
+#endif
+
+  /**
+   * Handles a message from a per-thing socket, or from the multiplexed
+   * socket if muxSlot is not negative.
+   */
+  void handleMessage(DynamicJsonDocument &newProp,
+                     AsyncWebSocketClient *client, ThingDevice *device,
+                     int muxSlot) {
+    (void)muxSlot;
+    const char *messageType = newProp["messageType"] | "";
     JsonVariant dataVariant = newProp["data"];
     if (!dataVariant.is<JsonObject>()) {
       sendErrorMsg(newProp, *client, 400, "data must be an object");
@@ -281,61 +598,226 @@ private:
 
     JsonObject data = dataVariant.as<JsonObject>();
 
-    if (messageType == "setProperty") {
+    if (!strcmp(messageType, "setProperty")) {
+#ifdef WITH_DEFERRED_CALLBACKS
+      // Rejected as a whole rather than applied in part
+      if (!device->canDeferWrites(data.size())) {
+        sendErrorMsg(newProp, *client, 503, "Too many pending writes");
+        return;
+      }
+#endif
       for (JsonPair kv : data) {
-        device->setProperty(kv.key().c_str(), kv.value());
+        if (!device->setProperty(kv.key().c_str(), kv.value())) {
+          sendErrorMsg(newProp, *client, 503, "Too many pending writes");
+          return;
+        }
       }
-    } else if (messageType == "requestAction") {
+#ifndef WITHOUT_ACTIONS
+    } else if (!strcmp(messageType, "requestAction")) {
       for (JsonPair kv : data) {
-        DynamicJsonDocument *actionRequest =
-            new DynamicJsonDocument(SMALL_JSON_DOCUMENT_SIZE);
-
-        JsonObject actionObj = actionRequest->to<JsonObject>();
+        ThingJsonLease bufferLease(SMALL_JSON_DOCUMENT_SIZE);
+        JsonObject actionObj = bufferLease->to<JsonObject>();
         JsonObject nested = actionObj.createNestedObject(kv.key());
 
         for (JsonPair kvInner : kv.value().as<JsonObject>()) {
           nested[kvInner.key()] = kvInner.value();
         }
 
+        // update() must not delete the action before it is announced and
+        // started
+        ThingActionHold hold(*device);
+        DynamicJsonDocument *actionRequest = thingJsonCopy(*bufferLease);
         ThingActionObject *obj = device->requestAction(actionRequest);
-        if (obj != nullptr) {
+        if (obj == nullptr) {
+          thingJsonFree(actionRequest);
+          // Unknown actions are ignored, known ones ran out of memory
+          if (device->findAction(kv.key().c_str()) != nullptr) {
+            sendErrorMsg(newProp, *client, 503, "Out of memory");
+            return;
+          }
+        } else {
           obj->setNotifyFunction(std::bind(&ThingDevice::sendActionStatus,
                                            device, std::placeholders::_1));
           device->sendActionStatus(obj);
 
-          obj->start();
+          obj->requestStart();
         }
       }
-    } else if (messageType == "addEventSubscription") {
+#endif
+#ifndef WITHOUT_EVENTS
+    } else if (!strcmp(messageType, "addEventSubscription")) {
       for (JsonPair kv : data) {
         ThingEvent *event = device->findEvent(kv.key().c_str());
-        if (event) {
-          device->addEventSubscription(client->id(), event->id);
+        if (!event) {
+          continue;
+        }
+
+#ifdef WITH_WS_MULTIPLEX
+        if (muxSlot >= 0) {
+          event->muxSubscribers |= thingClientBit(muxSlot);
+          continue;
         }
+#endif
+        device->addEventSubscription(client->id(), event->id);
       }
+#endif
+#ifdef WITH_WS_RESUME
+    } else if (!strcmp(messageType, "resume")) {
+      if (muxSlot >= 0) {
+        sendErrorMsg(newProp, *client, 400, "Resume on the thing's socket");
+        return;
+      }
+      device->resumeClient(client, data["seq"].as<uint32_t>());
+#endif
     }
   }
 
   void sendChangedProperties(ThingDevice *device) {
-    // Prepare one buffer per device
-    DynamicJsonDocument message(LARGE_JSON_DOCUMENT_SIZE);
+    ThingClientTable &clients = device->clients;
+    AsyncWebSocket *ws = (AsyncWebSocket *)device->ws;
+
+    // Clients over the soft limit only get their pending properties marked;
+    // clients that drained their queue since get one catch-up message.
+    ThingClientMask recovered = 0;
+    for (AsyncWebSocketClient *client : ws->getClients()) {
+      int slot = clients.find(client->id());
+      if (slot < 0 || client->status() != WS_CONNECTED) {
+        continue;
+      }
+
+      bool isLagging = client->queueLen() >= WS_CLIENT_QUEUE_SOFT_LIMIT;
+      if (clients.setLagging(slot, isLagging)) {
+        recovered |= thingClientBit(slot);
+      }
+    }
+
+    // Prepare one buffer per device, read again if a commit on the network
+    // task ran meanwhile
+    ThingJsonLease messageLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &message = *messageLease;
+    uint32_t since = device->notifiedVersion;
+    bool dataToSend;
+    uint32_t seq;
+    do {
+      seq = device->version.beginRead();
+      device->notifiedVersion = device->version.current;
+      message.clear();
+      message["messageType"] = "propertyStatus";
+      JsonObject prop = message.createNestedObject("data");
+      dataToSend = false;
+      ThingItem *item = device->firstProperty;
+      while (item != nullptr) {
+        if (item->version > since) {
+          dataToSend = true;
+          item->serializeValue(prop);
+        }
+        item = item->next;
+      }
+    } while (!device->version.endRead(seq));
+
+    ThingClientMask waiting = clients.lagging | recovered;
+    ThingItem *item = device->firstProperty;
+    while (item != nullptr) {
+      if (item->version > since) {
+        device->coalescedMessages +=
+            __builtin_popcount(item->pendingClients & waiting);
+        item->pendingClients |= waiting;
+      }
+      item = item->next;
+    }
+
+    String jsonStr;
+#ifdef WITH_MESSAGE_LOG
+    if (dataToSend) {
+      device->publish("propertyStatus", message, jsonStr);
+    }
+#endif
+    for (AsyncWebSocketClient *client : ws->getClients()) {
+      if (client->status() != WS_CONNECTED) {
+        continue;
+      }
+
+      // Clients without a slot were refused and are being closed
+      int slot = clients.find(client->id());
+      if (slot < 0) {
+        continue;
+      }
+
+      ThingClientMask bit = thingClientBit(slot);
+      if (recovered & bit) {
+        sendPendingProperties(device, client, slot);
+      } else if (dataToSend && !(clients.lagging & bit)) {
+        // Inform all connected ws clients of a Thing about changed
+        // properties
+        if (jsonStr.length() == 0) {
+          serializeJson(message, jsonStr);
+        }
+        device->sendMessage(client, slot, jsonStr);
+      }
+    }
+
+#ifdef WITH_WS_MULTIPLEX
+    if (dataToSend && mux.clients.used != 0) {
+      message["id"] = device->id.c_str();
+      jsonStr = "";
+      serializeJson(message, jsonStr);
+      mux.queueAll(jsonStr);
+    }
+#endif
+  }
+
+  /**
+   * Sends a client that fell behind the latest value of every property that
+   * changed while it was lagging, in a single propertyStatus message.
+   */
+  void sendPendingProperties(ThingDevice *device,
+                             AsyncWebSocketClient *client, int slot) {
+    ThingJsonLease messageLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &message = *messageLease;
     message["messageType"] = "propertyStatus";
     JsonObject prop = message.createNestedObject("data");
     bool dataToSend = false;
     ThingItem *item = device->firstProperty;
     while (item != nullptr) {
-      ThingDataValue *value = item->changedValueOrNull();
-      if (value) {
-        dataToSend = true;
+      if (item->pendingClients & thingClientBit(slot)) {
+        item->pendingClients &= ~thingClientBit(slot);
         item->serializeValue(prop);
+        dataToSend = true;
       }
       item = item->next;
     }
+
     if (dataToSend) {
       String jsonStr;
       serializeJson(message, jsonStr);
-      // Inform all connected ws clients of a Thing about changed properties
-      ((AsyncWebSocket *)device->ws)->textAll(jsonStr);
+      device->sendMessage(client, slot, jsonStr);
+    }
+  }
+#endif
+
+#ifdef WITH_SSE
+  /**
+   * Replays what a reconnecting event stream client missed according to its
+   * Last-Event-ID, or sends a snapshot if the log no longer has it.
+   */
+  void handleStreamConnect(AsyncEventSourceClient *client,
+                           ThingDevice *device) {
+    ThingMessageLog &log = device->log;
+    uint32_t lastId = client->lastId();
+    if (lastId == 0) {
+      return;
+    }
+
+    if (!log.canResumeFrom(lastId)) {
+      String jsonStr;
+      device->serializePropertySnapshot(jsonStr);
+      client->send(jsonStr.c_str(), "propertyStatus", log.lastSeq);
+      return;
+    }
+
+    ThingMessageLog::Entry entry;
+    for (uint32_t seq = lastId + 1; log.copy(seq, entry); seq++) {
+      client->send(entry.data.c_str(), entry.type, entry.seq);
     }
   }
 #endif
@@ -361,13 +843,14 @@ private:
     AsyncResponseStream *response =
         request->beginResponseStream("application/json");
 
-    DynamicJsonDocument buf(LARGE_JSON_DOCUMENT_SIZE);
+    ThingJsonLease bufLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &buf = *bufLease;
     JsonArray things = buf.to<JsonArray>();
     ThingDevice *device = this->firstDevice;
     while (device != nullptr) {
       JsonObject descr = things.createNestedObject();
       device->serialize(descr, ip, port);
-      descr["href"] = "/things/" + device->id;
+      descr["href"] = device->href.c_str();
       device = device->next;
     }
 
@@ -382,7 +865,8 @@ private:
     AsyncResponseStream *response =
         request->beginResponseStream("application/json");
 
-    DynamicJsonDocument buf(LARGE_JSON_DOCUMENT_SIZE);
+    ThingJsonLease bufLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &buf = *bufLease;
     JsonObject descr = buf.to<JsonObject>();
     device->serialize(descr, ip, port);
 
@@ -391,18 +875,199 @@ private:
   }
 
   void handleThingPropertyGet(AsyncWebServerRequest *request,
-                              ThingItem *item) {
+                              ThingDevice *device, ThingItem *item) {
     if (!verifyHost(request)) {
       return;
     }
+    handlePropertyRead(request, device, item);
+  }
+
+  /**
+   * Answers a read of one property, or of all properties if item is null.
+   * With ?waitFor=<version> the request is held until a value changes after
+   * that version or ?timeout=<ms> passes. With ?since=<version> only the
+   * properties changed after that version are included.
+   */
+  void handlePropertyRead(AsyncWebServerRequest *request, ThingDevice *device,
+                          ThingItem *item) {
+    long since = -1;
+    if (item == nullptr && request->hasParam("since")) {
+      since = request->getParam("since")->value().toInt();
+    }
+
+    if (request->hasParam("waitFor")) {
+      uint32_t waitFor = request->getParam("waitFor")->value().toInt();
+      unsigned long timeout = LONG_POLL_DEFAULT_TIMEOUT;
+      if (request->hasParam("timeout")) {
+        timeout = request->getParam("timeout")->value().toInt();
+      }
+      if (timeout > LONG_POLL_MAX_TIMEOUT) {
+        timeout = LONG_POLL_MAX_TIMEOUT;
+      }
+
+      if (!device->hasChangedSince(item, waitFor) &&
+          parkRead(request, device, item, waitFor, since, timeout, false)) {
+        return;
+      }
+    }
+
+    // Samplers only run from update(), so wait for it to refresh a value
+    // that went stale while nobody was watching
+    if (device->needsSample(item) &&
+        parkRead(request, device, item, 0, since, LONG_POLL_DEFAULT_TIMEOUT,
+                 true)) {
+      return;
+    }
+
+    sendPropertyValues(request, device, item, since);
+  }
+
+  bool parkRead(AsyncWebServerRequest *request, ThingDevice *device,
+                ThingItem *item, uint32_t waitFor, long since,
+                unsigned long timeout, bool sampling) {
+    PendingRead *slot = nullptr;
+    THING_LOCK(pendingLock);
+    for (PendingRead &pending : pendingReads) {
+      if (pending.device == nullptr) {
+        slot = &pending;
+        slot->device = device;
+        slot->item = item;
+        slot->waitFor = waitFor;
+        slot->since = since;
+        slot->deadline = millis() + timeout;
+        slot->sampling = sampling;
+        slot->parkedPass = samplePasses;
+        slot->ready = false;
+        break;
+      }
+    }
+    THING_UNLOCK(pendingLock);
+
+    if (slot == nullptr) {
+      // All slots are taken, answer right away
+      return false;
+    }
+
+    device->markPropertiesRead(item);
+    request->send(new ParkedResponse(this, slot));
+    return true;
+  }
+
+  bool isReadReady(PendingRead *slot) {
+    THING_LOCK(pendingLock);
+    bool ready = slot->ready;
+    THING_UNLOCK(pendingLock);
+    return ready;
+  }
+
+  void releaseRead(PendingRead *slot) {
+    THING_LOCK(pendingLock);
+    slot->device = nullptr;
+    THING_UNLOCK(pendingLock);
+  }
+
+  /**
+   * Runs sketch code on behalf of the request handlers and interrupt
+   * handlers: deferred property writes and action starts, values set from
+   * interrupts, the ticks of running actions and property samplers.
+   */
+  void runCallbacks() {
+    ThingDevice *device = this->firstDevice;
+    while (device != nullptr) {
+#ifdef WITH_ISR_VALUES
+      device->applyISRValues();
+#endif
+#ifdef WITH_DEFERRED_CALLBACKS
+      device->applyDeferredWrites();
+#endif
+      device->tickActions();
+      device->sampleProperties();
+      device = device->next;
+    }
+  }
+
+  void updateWatchers() {
+    ThingDevice *device = this->firstDevice;
+    while (device != nullptr) {
+      uint16_t streams = 0;
+#ifdef WITH_SSE
+      streams = device->sse->count();
+#endif
+      device->updateWatchers(streams);
+      device = device->next;
+    }
+  }
+
+  /**
+   * Marks the parked reads that can be answered now, called after the
+   * samplers ran.
+   */
+  void answerPendingReads() {
+    unsigned long now = millis();
+    THING_LOCK(pendingLock);
+    samplePasses++;
+    for (PendingRead &pending : pendingReads) {
+      if (pending.device == nullptr || pending.ready) {
+        continue;
+      }
+
+      bool due;
+      if (pending.sampling) {
+        // A read parked while the samplers ran waits for the next pass
+        due = !pending.device->needsSample(pending.item) ||
+              samplePasses - pending.parkedPass >= 2;
+      } else {
+        due = pending.device->hasChangedSince(pending.item, pending.waitFor);
+      }
+      if (due || (long)(now - pending.deadline) >= 0) {
+        pending.ready = true;
+      }
+    }
+    THING_UNLOCK(pendingLock);
+  }
+
+  /**
+   * Sends one property, or all properties if item is null. A since other
+   * than -1 limits the properties to those changed after that version.
+   */
+  void sendPropertyValues(AsyncWebServerRequest *request, ThingDevice *device,
+                          ThingItem *item, long since) {
     AsyncResponseStream *response =
         request->beginResponseStream("application/json");
+    writePropertyValues(response, device, item, since);
+    request->send(response);
+  }
 
-    DynamicJsonDocument doc(SMALL_JSON_DOCUMENT_SIZE);
-    JsonObject prop = doc.to<JsonObject>();
-    item->serializeValue(prop);
+  void writePropertyValues(AsyncResponseStream *response, ThingDevice *device,
+                           ThingItem *item, long since) {
+    device->markPropertiesRead(item);
+
+    ThingJsonLease docLease(item != nullptr ? SMALL_JSON_DOCUMENT_SIZE
+                                            : LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &doc = *docLease;
+    JsonObject prop;
+    uint32_t current;
+    // Read again if a commit on the other task ran meanwhile, so that the
+    // values of one update are never answered in part
+    uint32_t seq;
+    do {
+      seq = device->version.beginRead();
+      current = device->version.current;
+      prop = doc.to<JsonObject>();
+      if (item != nullptr) {
+        item->serializeValue(prop);
+      } else if (since >= 0) {
+        device->serializeChangedValues(prop, since);
+      } else {
+        ThingItem *property = device->firstProperty;
+        while (property != nullptr) {
+          property->serializeValue(prop);
+          property = property->next;
+        }
+      }
+    } while (!device->version.endRead(seq));
+    response->addHeader("X-Thing-Version", String(current));
     serializeJson(prop, *response);
-    request->send(response);
   }
 
   void handleThingActionGet(AsyncWebServerRequest *request,
@@ -411,36 +1076,32 @@ private:
       return;
     }
 
-    String url = request->url();
-    String base = "/things/" + device->id + "/actions/" + action->id;
-    if (url == base || url == base + "/") {
+    const String &url = request->url();
+    const String &base = action->href;
+    // Routed here for the action's href and anything below it
+    if (url.length() <= base.length() + 1) {
       AsyncResponseStream *response =
           request->beginResponseStream("application/json");
-      DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+      ThingJsonLease docLease(LARGE_JSON_DOCUMENT_SIZE);
+      DynamicJsonDocument &doc = *docLease;
       JsonArray queue = doc.to<JsonArray>();
       device->serializeActionQueue(queue, action->id);
       serializeJson(queue, *response);
       request->send(response);
     } else {
-      String actionId = url.substring(base.length() + 1);
-      const char *actionIdC = actionId.c_str();
-      const char *slash = strchr(actionIdC, '/');
+      char actionId[THING_ACTION_ID_LENGTH + 2];
+      thingActionIdOf(url.c_str() + base.length() + 1, actionId);
 
-      if (slash) {
-        actionId = actionId.substring(0, slash - actionIdC);
-      }
-
-      ThingActionObject *obj = device->findActionObject(actionId.c_str());
-      if (obj == nullptr) {
+      ThingJsonLease docLease(SMALL_JSON_DOCUMENT_SIZE);
+      DynamicJsonDocument &doc = *docLease;
+      JsonObject o = doc.to<JsonObject>();
+      if (!device->serializeActionObject(o, actionId)) {
         request->send(404);
         return;
       }
 
       AsyncResponseStream *response =
           request->beginResponseStream("application/json");
-      DynamicJsonDocument doc(SMALL_JSON_DOCUMENT_SIZE);
-      JsonObject o = doc.to<JsonObject>();
-      obj->serialize(o, device->id);
       serializeJson(o, *response);
       request->send(response);
     }
@@ -452,22 +1113,18 @@ private:
       return;
     }
 
-    String url = request->url();
-    String base = "/things/" + device->id + "/actions/" + action->id;
-    if (url == base || url == base + "/") {
+    const String &url = request->url();
+    const String &base = action->href;
+    // Routed here for the action's href and anything below it
+    if (url.length() <= base.length() + 1) {
       request->send(404);
       return;
     }
 
-    String actionId = url.substring(base.length() + 1);
-    const char *actionIdC = actionId.c_str();
-    const char *slash = strchr(actionIdC, '/');
-
-    if (slash) {
-      actionId = actionId.substring(0, slash - actionIdC);
-    }
+    char actionId[THING_ACTION_ID_LENGTH + 2];
+    thingActionIdOf(url.c_str() + base.length() + 1, actionId);
 
-    device->removeAction(actionId);
+    device->requestRemoveAction(actionId);
     request->send(204);
   }
 
@@ -477,39 +1134,39 @@ private:
       return;
     }
 
-    if (!b_has_body_data) {
-      request->send(422); // unprocessable entity (b/c no body)
+    char *body = requestBody(request);
+    if (body == nullptr) {
       return;
     }
 
-    DynamicJsonDocument *newBuffer =
-        new DynamicJsonDocument(SMALL_JSON_DOCUMENT_SIZE);
-    auto error = deserializeJson(*newBuffer, (const char *)body_data);
+    StaticJsonDocument<JSON_OBJECT_SIZE(1)> filter;
+    filter[action->id.c_str()] = true;
+
+    ThingJsonLease newBufferLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &newBuffer = *newBufferLease;
+    auto error = deserializeJson(newBuffer, body,
+                                 DeserializationOption::Filter(filter));
     if (error) { // unable to parse json
-      b_has_body_data = false;
-      memset(body_data, 0, sizeof(body_data));
       request->send(500);
-      delete newBuffer;
       return;
     }
 
-    JsonObject newAction = newBuffer->as<JsonObject>();
+    JsonObject newAction = newBuffer.as<JsonObject>();
 
     if (!newAction.containsKey(action->id)) {
-      b_has_body_data = false;
-      memset(body_data, 0, sizeof(body_data));
       request->send(400);
-      delete newBuffer;
       return;
     }
 
-    ThingActionObject *obj = device->requestAction(newBuffer);
+    // update() must not delete the action before it is answered and started
+    ThingActionHold hold(*device);
+    DynamicJsonDocument *actionRequest = thingJsonCopy(newBuffer);
+    ThingActionObject *obj = device->requestAction(actionRequest);
 
     if (obj == nullptr) {
-      b_has_body_data = false;
-      memset(body_data, 0, sizeof(body_data));
-      request->send(500);
-      delete newBuffer;
+      // The action exists, so memory for it has run out
+      request->send(503);
+      thingJsonFree(actionRequest);
       return;
     }
 
@@ -518,7 +1175,8 @@ private:
                                      std::placeholders::_1));
 #endif
 
-    DynamicJsonDocument respBuffer(SMALL_JSON_DOCUMENT_SIZE);
+    ThingJsonLease respBufferLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &respBuffer = *respBufferLease;
     JsonObject item = respBuffer.to<JsonObject>();
     obj->serialize(item, device->id);
     String jsonStr;
@@ -527,10 +1185,7 @@ private:
         request->beginResponse(201, "application/json", jsonStr);
     request->send(response);
 
-    b_has_body_data = false;
-    memset(body_data, 0, sizeof(body_data));
-
-    obj->start();
+    obj->requestStart();
   }
 
   void handleThingEventGet(AsyncWebServerRequest *request, ThingDevice *device,
@@ -541,7 +1196,9 @@ private:
     AsyncResponseStream *response =
         request->beginResponseStream("application/json");
 
-    DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+    item->markRead();
+    ThingJsonLease docLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &doc = *docLease;
     JsonArray queue = doc.to<JsonArray>();
     device->serializeEventQueue(queue, item->id);
     serializeJson(queue, *response);
@@ -549,22 +1206,11 @@ private:
   }
 
   void handleThingPropertiesGet(AsyncWebServerRequest *request,
-                                ThingItem *rootItem) {
+                                ThingDevice *device) {
     if (!verifyHost(request)) {
       return;
     }
-    AsyncResponseStream *response =
-        request->beginResponseStream("application/json");
-
-    DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
-    JsonObject prop = doc.to<JsonObject>();
-    ThingItem *item = rootItem;
-    while (item != nullptr) {
-      item->serializeValue(prop);
-      item = item->next;
-    }
-    serializeJson(prop, *response);
-    request->send(response);
+    handlePropertyRead(request, device, nullptr);
   }
 
   void handleThingActionsGet(AsyncWebServerRequest *request,
@@ -575,7 +1221,8 @@ private:
     AsyncResponseStream *response =
         request->beginResponseStream("application/json");
 
-    DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+    ThingJsonLease docLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &doc = *docLease;
     JsonArray queue = doc.to<JsonArray>();
     device->serializeActionQueue(queue);
     serializeJson(queue, *response);
@@ -588,39 +1235,36 @@ private:
       return;
     }
 
-    if (!b_has_body_data) {
-      request->send(422); // unprocessable entity (b/c no body)
+    char *body = requestBody(request);
+    if (body == nullptr) {
       return;
     }
 
-    DynamicJsonDocument *newBuffer =
-        new DynamicJsonDocument(SMALL_JSON_DOCUMENT_SIZE);
-    auto error = deserializeJson(*newBuffer, (const char *)body_data);
+    ThingJsonLease newBufferLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &newBuffer = *newBufferLease;
+    auto error = deserializeJson(newBuffer, body);
     if (error) { // unable to parse json
-      b_has_body_data = false;
-      memset(body_data, 0, sizeof(body_data));
       request->send(500);
-      delete newBuffer;
       return;
     }
 
-    JsonObject newAction = newBuffer->as<JsonObject>();
+    JsonObject newAction = newBuffer.as<JsonObject>();
 
-    if (newAction.size() != 1) {
-      b_has_body_data = false;
-      memset(body_data, 0, sizeof(body_data));
+    if (newAction.size() != 1 ||
+        device->findAction(newAction.begin()->key().c_str()) == nullptr) {
       request->send(400);
-      delete newBuffer;
       return;
     }
 
-    ThingActionObject *obj = device->requestAction(newBuffer);
+    // update() must not delete the action before it is answered and started
+    ThingActionHold hold(*device);
+    DynamicJsonDocument *actionRequest = thingJsonCopy(newBuffer);
+    ThingActionObject *obj = device->requestAction(actionRequest);
 
     if (obj == nullptr) {
-      b_has_body_data = false;
-      memset(body_data, 0, sizeof(body_data));
-      request->send(500);
-      delete newBuffer;
+      // The action exists, so memory for it has run out
+      request->send(503);
+      thingJsonFree(actionRequest);
       return;
     }
 
@@ -629,7 +1273,8 @@ private:
                                      std::placeholders::_1));
 #endif
 
-    DynamicJsonDocument respBuffer(SMALL_JSON_DOCUMENT_SIZE);
+    ThingJsonLease respBufferLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &respBuffer = *respBufferLease;
     JsonObject item = respBuffer.to<JsonObject>();
     obj->serialize(item, device->id);
     String jsonStr;
@@ -638,10 +1283,7 @@ private:
         request->beginResponse(201, "application/json", jsonStr);
     request->send(response);
 
-    b_has_body_data = false;
-    memset(body_data, 0, sizeof(body_data));
-
-    obj->start();
+    obj->requestStart();
   }
 
   void handleThingEventsGet(AsyncWebServerRequest *request,
@@ -652,22 +1294,59 @@ private:
     AsyncResponseStream *response =
         request->beginResponseStream("application/json");
 
-    DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+    ThingItem *event = device->firstEvent;
+    while (event != nullptr) {
+      event->markRead();
+      event = event->next;
+    }
+
+    ThingJsonLease docLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &doc = *docLease;
     JsonArray queue = doc.to<JsonArray>();
     device->serializeEventQueue(queue);
     serializeJson(queue, *response);
     request->send(response);
   }
 
+  /**
+   * Collects the body of a PUT or POST in a buffer that belongs to the
+   * request and is freed along with it. Bodies over ESP_MAX_PUT_BODY_SIZE
+   * are not stored, see requestBody().
+   */
   void handleBody(AsyncWebServerRequest *request, uint8_t *data, size_t len,
                   size_t index, size_t total) {
-    if (total >= ESP_MAX_PUT_BODY_SIZE ||
-        index + len >= ESP_MAX_PUT_BODY_SIZE) {
-      return; // cannot store this size..
+    if (total > ESP_MAX_PUT_BODY_SIZE) {
+      return;
+    }
+    if (index == 0 && request->_tempObject == nullptr) {
+      request->_tempObject = malloc(total + 1);
+    }
+    char *body = (char *)request->_tempObject;
+    if (body == nullptr || index + len > total) {
+      return;
+    }
+    memcpy(&body[index], data, len);
+    body[index + len] = '\0';
+  }
+
+  /**
+   * Returns the body collected by handleBody(), or sends an error and
+   * returns nullptr if there is none.
+   */
+  char *requestBody(AsyncWebServerRequest *request) {
+    if (request->contentLength() > ESP_MAX_PUT_BODY_SIZE) {
+      request->send(413); // payload too large
+      return nullptr;
+    }
+    if (request->contentLength() == 0) {
+      request->send(422); // unprocessable entity (b/c no body)
+      return nullptr;
     }
-    // copy to internal buffer
-    memcpy(&body_data[index], data, len);
-    b_has_body_data = true;
+    if (request->_tempObject == nullptr) {
+      request->send(500); // out of memory
+      return nullptr;
+    }
+    return (char *)request->_tempObject;
   }
 
   void handleThingPropertyPut(AsyncWebServerRequest *request,
@@ -675,37 +1354,93 @@ private:
     if (!verifyHost(request)) {
       return;
     }
-    if (!b_has_body_data) {
-      request->send(422); // unprocessable entity (b/c no body)
+    char *body = requestBody(request);
+    if (body == nullptr) {
       return;
     }
 
-    DynamicJsonDocument newBuffer(SMALL_JSON_DOCUMENT_SIZE);
-    auto error = deserializeJson(newBuffer, body_data);
+    StaticJsonDocument<JSON_OBJECT_SIZE(1)> filter;
+    filter[property->id.c_str()] = true;
+
+    ThingJsonLease newBufferLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &newBuffer = *newBufferLease;
+    auto error = deserializeJson(newBuffer, body,
+                                 DeserializationOption::Filter(filter));
     if (error) { // unable to parse json
-      b_has_body_data = false;
-      memset(body_data, 0, sizeof(body_data));
       request->send(500);
       return;
     }
     JsonObject newProp = newBuffer.as<JsonObject>();
 
     if (!newProp.containsKey(property->id)) {
-      b_has_body_data = false;
-      memset(body_data, 0, sizeof(body_data));
       request->send(400);
       return;
     }
 
-    device->setProperty(property->id.c_str(), newProp[property->id]);
+    if (!device->setProperty(property->id.c_str(), newProp[property->id])) {
+      // Too many writes are waiting for update()
+      request->send(503);
+      return;
+    }
 
     AsyncResponseStream *response =
         request->beginResponseStream("application/json");
     serializeJson(newProp, *response);
     request->send(response);
+  }
+
+  /**
+   * Applies several properties from one JSON object, e.g.
+   * {"on": true, "level": 40}. Changes made before the next update() are
+   * reported to WebSocket clients in a single propertyStatus message.
+   */
+  void handleThingPropertiesPut(AsyncWebServerRequest *request,
+                                ThingDevice *device) {
+    if (!verifyHost(request)) {
+      return;
+    }
+    // Unknown properties below the collection end up here as well
+    const String &url = request->url();
+    if (!url.startsWith(device->href) ||
+        strcmp(url.c_str() + device->href.length(), "/properties") != 0) {
+      request->send(404);
+      return;
+    }
+    char *body = requestBody(request);
+    if (body == nullptr) {
+      return;
+    }
+
+    ThingJsonLease newBufferLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &newBuffer = *newBufferLease;
+    auto error = deserializeJson(newBuffer, body);
+    if (error) { // unable to parse json
+      request->send(500);
+      return;
+    }
+    JsonObject newProps = newBuffer.as<JsonObject>();
+
+    if (newProps.isNull()) {
+      request->send(400);
+      return;
+    }
 
-    b_has_body_data = false;
-    memset(body_data, 0, sizeof(body_data));
+#ifdef WITH_DEFERRED_CALLBACKS
+    if (!device->canDeferWrites(newProps.size())) {
+      request->send(503);
+      return;
+    }
+#endif
+
+    if (!device->setProperties(newProps)) {
+      request->send(400);
+      return;
+    }
+
+    AsyncResponseStream *response =
+        request->beginResponseStream("application/json");
+    serializeJson(newProps, *response);
+    request->send(response);
   }
 };
 
@@ -15,7 +15,59 @@
 #define WITHOUT_WS 1
 #endif
 
-#if !defined(WITHOUT_WS) && (defined(ESP8266) || defined(ESP32))
+// WebSocket options have no effect without WebSockets
+#ifdef WITHOUT_WS
+#undef WITH_WS_MULTIPLEX
+#undef WITH_WS_BATCH
+#undef WITH_WS_RESUME
+#endif
+
+// Only ESP boards run network callbacks outside of update()
+#if !defined(ESP8266) && !defined(ESP32)
+#undef WITH_DEFERRED_CALLBACKS
+#endif
+
+// Only the ESP32 reads values from another core
+#ifndef ESP32
+#undef WITH_THREAD_SAFE_VALUES
+#endif
+
+#ifdef WITH_STATIC_ALLOCATION
+// ESPAsyncWebServer allocates for every request and packet by itself
+#if defined(ESP8266) || defined(ESP32)
+#error "WITH_STATIC_ALLOCATION needs the Ethernet or WiFi101 adapter"
+#endif
+#ifndef WITH_JSON_POOL
+#define WITH_JSON_POOL 1
+#endif
+// Action requests that can exist at the same time
+#ifndef ACTION_POOL_SIZE
+#define ACTION_POOL_SIZE 4
+#endif
+// Events kept in the queue of a device, older ones are deleted
+#ifndef EVENT_QUEUE_SIZE
+#define EVENT_QUEUE_SIZE 8
+#endif
+// Event objects that can exist at the same time, across all devices
+#ifndef EVENT_POOL_SIZE
+#define EVENT_POOL_SIZE (EVENT_QUEUE_SIZE + 1)
+#endif
+// Longest timestamp kept in action and event objects
+#ifndef TIMESTAMP_LENGTH
+#define TIMESTAMP_LENGTH 29
+#endif
+// Longest message kept in the log of a device, longer ones are left out
+#ifndef MESSAGE_LOG_ENTRY_SIZE
+#define MESSAGE_LOG_ENTRY_SIZE 128
+#endif
+// Longest path a request can ask for, and that is put together for a link
+#ifndef REQUEST_URI_SIZE
+#define REQUEST_URI_SIZE 96
+#endif
+#endif
+
+#if (!defined(WITHOUT_WS) || defined(WITH_SSE)) &&                            \
+    (defined(ESP8266) || defined(ESP32))
 #include <ESPAsyncWebServer.h>
 #endif
 
@@ -49,33 +101,908 @@ union ThingDataValue {
 };
 typedef ThingDataValue ThingPropertyValue;
 
+/**
+ * Maps the C++ types of ThingPropertyT and ThingEventObject to a
+ * ThingDataType and the matching member of ThingDataValue at compile time.
+ */
+template <typename T> struct ThingDataTraits {
+  static_assert(sizeof(T) == 0, "typed properties and events take bool, "
+                                "int32_t, float or double values");
+};
+
+template <> struct ThingDataTraits<bool> {
+  static const ThingDataType type = BOOLEAN;
+  static ThingDataValue toValue(bool v) {
+    ThingDataValue value;
+    value.boolean = v;
+    return value;
+  }
+  static bool fromValue(ThingDataValue value) { return value.boolean; }
+};
+
+template <> struct ThingDataTraits<int32_t> {
+  static const ThingDataType type = INTEGER;
+  static ThingDataValue toValue(int32_t v) {
+    ThingDataValue value;
+    value.integer = v;
+    return value;
+  }
+  static int32_t fromValue(ThingDataValue value) {
+    return (int32_t)value.integer;
+  }
+};
+
+template <> struct ThingDataTraits<float> {
+  static const ThingDataType type = NUMBER;
+  static ThingDataValue toValue(float v) {
+    ThingDataValue value;
+    value.number = v;
+    return value;
+  }
+  static float fromValue(ThingDataValue value) { return (float)value.number; }
+};
+
+template <> struct ThingDataTraits<double> {
+  static const ThingDataType type = NUMBER;
+  static ThingDataValue toValue(double v) {
+    ThingDataValue value;
+    value.number = v;
+    return value;
+  }
+  static double fromValue(ThingDataValue value) { return value.number; }
+};
+
+/**
+ * Copies at most capacity characters of s into chars, which holds
+ * capacity + 1, and terminates it.
+ */
+inline void thingCopyString(char *chars, const char *s, size_t capacity) {
+  size_t n = 0;
+  while (s != nullptr && n < capacity && s[n] != '\0') {
+    chars[n] = s[n];
+    n++;
+  }
+  chars[n] = '\0';
+}
+
+/**
+ * A string of at most N characters kept inline, for strings that should
+ * not live on the heap. Longer values are cut short.
+ */
+template <size_t N> class FixedString {
+public:
+  FixedString() { chars[0] = '\0'; }
+
+  FixedString(const char *s) { *this = s; }
+
+  FixedString &operator=(const char *s) {
+    thingCopyString(chars, s, N);
+    return *this;
+  }
+
+  FixedString &operator=(const __FlashStringHelper *s) {
+    PGM_P p = reinterpret_cast<PGM_P>(s);
+    size_t n = 0;
+    while (n < N && (chars[n] = (char)pgm_read_byte(p + n)) != '\0') {
+      n++;
+    }
+    chars[n] = '\0';
+    return *this;
+  }
+
+  bool operator==(const char *s) const { return !strcmp(chars, s); }
+
+  bool operator!=(const char *s) const { return strcmp(chars, s) != 0; }
+
+  const char *c_str() const { return chars; }
+
+  char *data() { return chars; }
+
+  size_t length() const { return strlen(chars); }
+
+  static size_t capacity() { return N; }
+
+private:
+  char chars[N + 1];
+};
+
+/**
+ * Exchanges the buffers of two Strings without copying them, so that a
+ * String prepared outside of a critical section can be put in place
+ * inside it without allocating.
+ */
+inline void thingSwap(String &a, String &b) {
+  String t(static_cast<String &&>(a));
+  a = static_cast<String &&>(b);
+  b = static_cast<String &&>(t);
+}
+
+// Timestamp of anything that happened without a clock, kept in flash
+static const char THING_EPOCH[] PROGMEM = "1970-01-01T00:00:00+00:00";
+#define THING_EPOCH_STRING ((const __FlashStringHelper *)THING_EPOCH)
+
+// Characters of the ids generated for action requests
+#define THING_ACTION_ID_LENGTH 16
+
+/**
+ * Copies the path segment that path starts with, up to the next '/', into
+ * id. Longer segments than action ids are cut one character longer, so
+ * that they match none.
+ */
+inline void thingActionIdOf(const char *path,
+                            char (&id)[THING_ACTION_ID_LENGTH + 2]) {
+  thingCopyString(id, path, THING_ACTION_ID_LENGTH + 1);
+  char *slash = strchr(id, '/');
+  if (slash != nullptr) {
+    *slash = '\0';
+  }
+}
+
+/**
+ * Sets v to a copy of the path made of the given parts, e.g. a link. With
+ * WITH_STATIC_ALLOCATION it is put together on the stack instead of in a
+ * String, and cut at REQUEST_URI_SIZE characters.
+ */
+inline void thingSetPath(JsonVariant v, const char *a, const char *b,
+                         const char *c = "", const char *d = "",
+                         const char *e = "", const char *f = "") {
+#ifdef WITH_STATIC_ALLOCATION
+  char path[REQUEST_URI_SIZE + 1];
+  const char *parts[] = {a, b, c, d, e, f};
+  size_t n = 0;
+  for (const char *part : parts) {
+    while (*part != '\0' && n < REQUEST_URI_SIZE) {
+      path[n++] = *part++;
+    }
+  }
+  path[n] = '\0';
+  // A char * rather than a const char * is copied into the document
+  v.set(path);
+#else
+  String path;
+  path.reserve(strlen(a) + strlen(b) + strlen(c) + strlen(d) + strlen(e) +
+               strlen(f));
+  path += a;
+  path += b;
+  path += c;
+  path += d;
+  path += e;
+  path += f;
+  v.set(path);
+#endif
+}
+
+#ifdef ESP32
+// Short critical section for state shared with the AsyncTCP task, which
+// runs in parallel to loop()
+typedef portMUX_TYPE ThingLock;
+#define THING_LOCK_INITIALIZER portMUX_INITIALIZER_UNLOCKED
+#define THING_LOCK(lock) portENTER_CRITICAL(&(lock))
+#define THING_UNLOCK(lock) portEXIT_CRITICAL(&(lock))
+#else
+// Network callbacks never preempt loop() on the other boards
+typedef uint8_t ThingLock;
+#define THING_LOCK_INITIALIZER 0
+#define THING_LOCK(lock) (void)(lock)
+#define THING_UNLOCK(lock) (void)(lock)
+#endif
+
+#ifdef WITH_ISR_VALUES
+#if defined(ESP32)
+#define THING_ISR_ATTR IRAM_ATTR
+// Taken inside the interrupt handler, which may run on the other core
+#define THING_LOCK_ISR(lock) portENTER_CRITICAL_ISR(&(lock))
+#define THING_UNLOCK_ISR(lock) portEXIT_CRITICAL_ISR(&(lock))
+// Taken by loop() to keep the interrupt handler out
+#define THING_BLOCK_ISR(lock) portENTER_CRITICAL(&(lock))
+#define THING_UNBLOCK_ISR(lock) portEXIT_CRITICAL(&(lock))
+#else
+#if defined(ESP8266)
+#define THING_ISR_ATTR IRAM_ATTR
+#else
+#define THING_ISR_ATTR
+#endif
+#define THING_LOCK_ISR(lock) (void)(lock)
+#define THING_UNLOCK_ISR(lock) (void)(lock)
+#define THING_BLOCK_ISR(lock) noInterrupts()
+#define THING_UNBLOCK_ISR(lock) interrupts()
+#endif
+#endif
+
+#ifdef WITH_JSON_POOL
+// A request or message holds up to two small documents and a large one,
+// while update() holds a large one, possibly at the same time on the ESP32
+#ifndef JSON_POOL_SMALL_DOCUMENTS
+#define JSON_POOL_SMALL_DOCUMENTS 3
+#endif
+#ifndef JSON_POOL_LARGE_DOCUMENTS
+#define JSON_POOL_LARGE_DOCUMENTS 2
+#endif
+
+static_assert(JSON_POOL_SMALL_DOCUMENTS + JSON_POOL_LARGE_DOCUMENTS > 0,
+              "the JSON pool needs at least one document");
+
+/**
+ * JSON documents allocated once and lent to handlers, so that serving a
+ * request does not allocate and free a block on the heap. Requests that
+ * find the pool exhausted get a document of their own, as without a pool,
+ * unless the pool cannot grow.
+ */
+class ThingJsonPool {
+public:
+  /** Number of documents that had to be allocated because none was free. */
+  unsigned long fallbacks = 0;
+
+  ThingJsonPool(int smallCount, int largeCount, bool canGrow_ = true)
+      : slotCount(smallCount + largeCount), canGrow(canGrow_) {
+    slots = new Slot[slotCount];
+    for (int i = 0; i < slotCount; i++) {
+      size_t capacity = i < smallCount ? SMALL_JSON_DOCUMENT_SIZE
+                                       : LARGE_JSON_DOCUMENT_SIZE;
+      slots[i].doc = new DynamicJsonDocument(capacity);
+      slots[i].used = false;
+    }
+  }
+
+  /**
+   * Lends a free document of the smallest size that holds capacity. Larger
+   * ones are kept for the requests that need them, so if none of that size
+   * is free, a document is allocated, or nullptr returned if the pool
+   * cannot grow.
+   */
+  DynamicJsonDocument *acquire(size_t capacity) {
+    size_t fit = 0;
+    for (int i = 0; i < slotCount; i++) {
+      size_t slotCapacity = slots[i].doc->capacity();
+      if (slotCapacity >= capacity && (fit == 0 || slotCapacity < fit)) {
+        fit = slotCapacity;
+      }
+    }
+
+    DynamicJsonDocument *doc = nullptr;
+    THING_LOCK(lock);
+    for (int i = 0; i < slotCount; i++) {
+      if (!slots[i].used && slots[i].doc->capacity() == fit) {
+        slots[i].used = true;
+        doc = slots[i].doc;
+        break;
+      }
+    }
+    if (doc == nullptr) {
+      fallbacks++;
+    }
+    THING_UNLOCK(lock);
+
+    if (doc == nullptr && canGrow) {
+      doc = new DynamicJsonDocument(capacity);
+    }
+    return doc;
+  }
+
+  /** Whether every document is lent, so that acquire() has to grow. */
+  bool isFull() {
+    bool full = true;
+    THING_LOCK(lock);
+    for (int i = 0; i < slotCount; i++) {
+      if (!slots[i].used) {
+        full = false;
+        break;
+      }
+    }
+    THING_UNLOCK(lock);
+    return full;
+  }
+
+  void release(DynamicJsonDocument *doc) {
+    doc->clear();
+    THING_LOCK(lock);
+    for (int i = 0; i < slotCount; i++) {
+      if (slots[i].doc == doc) {
+        slots[i].used = false;
+        THING_UNLOCK(lock);
+        return;
+      }
+    }
+    THING_UNLOCK(lock);
+    delete doc;
+  }
+
+private:
+  struct Slot {
+    DynamicJsonDocument *doc;
+    bool used;
+  };
+
+  Slot *slots;
+  int slotCount;
+  bool canGrow;
+  ThingLock lock = THING_LOCK_INITIALIZER;
+};
+
+/**
+ * The pool shared by all devices and adapters. It is allocated on first use,
+ * which the adapters make happen in begin().
+ */
+inline ThingJsonPool &thingJsonPool() {
+  static ThingJsonPool pool(JSON_POOL_SMALL_DOCUMENTS,
+                            JSON_POOL_LARGE_DOCUMENTS);
+  return pool;
+}
+#endif
+
+#ifdef WITH_STATIC_ALLOCATION
+/** Documents holding the requests of queued actions. */
+inline ThingJsonPool &thingActionPool() {
+  static ThingJsonPool pool(ACTION_POOL_SIZE, 0, false);
+  return pool;
+}
+
+/**
+ * A fixed number of blocks for objects of one class, which allocates from
+ * it through its own operator new. Allocations fail with nullptr once all
+ * blocks are taken or for objects of a larger subclass.
+ */
+template <size_t SIZE, int COUNT> class ThingSlab {
+public:
+  void *allocate(size_t size) {
+    if (size > SIZE) {
+      return nullptr;
+    }
+    for (int i = 0; i < COUNT; i++) {
+      if (!used[i]) {
+        used[i] = true;
+        return blocks[i].bytes;
+      }
+    }
+    return nullptr;
+  }
+
+  bool isFull() {
+    for (int i = 0; i < COUNT; i++) {
+      if (!used[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void release(void *ptr) {
+    for (int i = 0; i < COUNT; i++) {
+      if (blocks[i].bytes == ptr) {
+        used[i] = false;
+        return;
+      }
+    }
+  }
+
+private:
+  union Block {
+    uint8_t bytes[SIZE];
+    long long alignInteger;
+    double alignNumber;
+    void *alignPointer;
+  };
+
+  Block blocks[COUNT];
+  bool used[COUNT] = {};
+};
+#endif
+
+/**
+ * A JSON document for the duration of a handler. With WITH_JSON_POOL it is
+ * borrowed from the pool, otherwise it is allocated as it always was.
+ */
+class ThingJsonLease {
+public:
+#ifdef WITH_JSON_POOL
+  explicit ThingJsonLease(size_t capacity)
+      : doc(thingJsonPool().acquire(capacity)) {}
+  ~ThingJsonLease() { thingJsonPool().release(doc); }
+#else
+  explicit ThingJsonLease(size_t capacity) : own(capacity), doc(&own) {}
+#endif
+
+  ThingJsonLease(const ThingJsonLease &) = delete;
+  ThingJsonLease &operator=(const ThingJsonLease &) = delete;
+
+  DynamicJsonDocument &operator*() { return *doc; }
+  DynamicJsonDocument *operator->() { return doc; }
+
+private:
+#ifndef WITH_JSON_POOL
+  DynamicJsonDocument own;
+#endif
+  DynamicJsonDocument *doc;
+};
+
+/**
+ * Copies a parsed document that has to outlive the handler, such as an
+ * action request, into a heap document no larger than it needs. The copy
+ * goes through text so that strings parsed in place are duplicated too.
+ * Returns nullptr if the copy cannot be made. With WITH_STATIC_ALLOCATION
+ * the copy comes from the action pool instead, and is nullptr once that is
+ * exhausted; the adapters that mode supports never parse in place. Free
+ * the copy with thingJsonFree().
+ */
+inline DynamicJsonDocument *thingJsonCopy(const JsonDocument &src) {
+#ifdef WITH_STATIC_ALLOCATION
+  DynamicJsonDocument *copy =
+      thingActionPool().acquire(SMALL_JSON_DOCUMENT_SIZE);
+  if (copy != nullptr && !copy->set(src)) {
+    thingActionPool().release(copy);
+    return nullptr;
+  }
+#else
+  String json;
+  serializeJson(src, json);
+  DynamicJsonDocument *copy =
+      new DynamicJsonDocument(src.memoryUsage() + json.length() + 1);
+  if (deserializeJson(*copy, (const char *)json.c_str())) {
+    // Out of memory, which the caller handles like an exhausted pool
+    delete copy;
+    return nullptr;
+  }
+  copy->shrinkToFit();
+#endif
+  return copy;
+}
+
+inline void thingJsonFree(DynamicJsonDocument *doc) {
+#ifdef WITH_STATIC_ALLOCATION
+  if (doc != nullptr) {
+    thingActionPool().release(doc);
+  }
+#else
+  delete doc;
+#endif
+}
+
+#ifdef WITH_DEFERRED_CALLBACKS
+// Properties per device with a network write waiting for update()
+#ifndef DEFERRED_QUEUE_SIZE
+#define DEFERRED_QUEUE_SIZE 16
+#endif
+#endif
+
+// How long a read through the HTTP API keeps an item watched (ms)
+#ifndef WATCH_READ_TIMEOUT
+#define WATCH_READ_TIMEOUT 60000
+#endif
+
+#ifndef WITHOUT_WS
+// Number of WebSocket clients per device that are tracked individually.
+#ifndef WS_MAX_CLIENTS
+#ifdef DEFAULT_MAX_WS_CLIENTS
+#define WS_MAX_CLIENTS DEFAULT_MAX_WS_CLIENTS
+#else
+#define WS_MAX_CLIENTS 8
+#endif
+#endif
+
+// Queued messages at which a client stops receiving events and action
+// statuses. Kept below the library limit so that nothing is dropped by
+// AsyncWebSocket itself.
+#ifndef WS_CLIENT_QUEUE_HARD_LIMIT
+#ifdef WS_MAX_QUEUED_MESSAGES
+#define WS_CLIENT_QUEUE_HARD_LIMIT (WS_MAX_QUEUED_MESSAGES - 1)
+#else
+#define WS_CLIENT_QUEUE_HARD_LIMIT 7
+#endif
+#endif
+
+// Queued messages at which a client is considered lagging and its property
+// updates are coalesced until it catches up.
+#ifndef WS_CLIENT_QUEUE_SOFT_LIMIT
+#define WS_CLIENT_QUEUE_SOFT_LIMIT (WS_CLIENT_QUEUE_HARD_LIMIT / 2)
+#endif
+
+typedef uint32_t ThingClientMask;
+
+static_assert(WS_MAX_CLIENTS <= 32, "WS_MAX_CLIENTS must fit a client mask");
+
+inline ThingClientMask thingClientBit(int slot) {
+  return (ThingClientMask)1 << slot;
+}
+
+/**
+ * Maps WebSocket client ids onto a small, fixed set of slots so that
+ * per-client state can be kept in bit masks. Clients attach and detach on
+ * the network task while update() marks them lagging, so the masks are
+ * only changed under the lock.
+ */
+class ThingClientTable {
+public:
+  uint32_t ids[WS_MAX_CLIENTS];
+  ThingClientMask used = 0;
+  ThingClientMask lagging = 0;
+  ThingLock lock = THING_LOCK_INITIALIZER;
+
+  int find(uint32_t id) {
+    for (int slot = 0; slot < WS_MAX_CLIENTS; slot++) {
+      if ((used & thingClientBit(slot)) && ids[slot] == id) {
+        return slot;
+      }
+    }
+    return -1;
+  }
+
+  /**
+   * Returns the slot of the client, allocating one if needed, or -1 if all
+   * slots are taken.
+   */
+  int attach(uint32_t id) {
+    THING_LOCK(lock);
+    int slot = find(id);
+    if (slot < 0) {
+      for (int free = 0; free < WS_MAX_CLIENTS; free++) {
+        if (!(used & thingClientBit(free))) {
+          ids[free] = id;
+          used |= thingClientBit(free);
+          lagging &= ~thingClientBit(free);
+          slot = free;
+          break;
+        }
+      }
+    }
+    THING_UNLOCK(lock);
+    return slot;
+  }
+
+  void detach(int slot) {
+    THING_LOCK(lock);
+    used &= ~thingClientBit(slot);
+    lagging &= ~thingClientBit(slot);
+    THING_UNLOCK(lock);
+  }
+
+  /** Reads the id of the client in a slot. Returns false if it is free. */
+  bool idOf(int slot, uint32_t *id) {
+    THING_LOCK(lock);
+    bool attached = used & thingClientBit(slot);
+    *id = ids[slot];
+    THING_UNLOCK(lock);
+    return attached;
+  }
+
+  /** Returns the clients that are attached and keeping up. */
+  ThingClientMask ready() {
+    THING_LOCK(lock);
+    ThingClientMask mask = used & ~lagging;
+    THING_UNLOCK(lock);
+    return mask;
+  }
+
+  /**
+   * Marks an attached client as lagging or not. Returns whether it was
+   * lagging and no longer is.
+   */
+  bool setLagging(int slot, bool isLagging) {
+    ThingClientMask bit = thingClientBit(slot);
+    THING_LOCK(lock);
+    bool recovered = !isLagging && (lagging & bit);
+    if (isLagging && (used & bit)) {
+      lagging |= bit;
+    } else {
+      lagging &= ~bit;
+    }
+    THING_UNLOCK(lock);
+    return recovered;
+  }
+};
+
+/**
+ * Per-client buffers collecting messages that are sent together as a single
+ * JSON array frame. Messages may be added from the network task while
+ * update() flushes, so the frames are only touched under the lock.
+ */
+class ThingOutbox {
+public:
+  String frames[WS_MAX_CLIENTS];
+  ThingLock lock = THING_LOCK_INITIALIZER;
+
+  /**
+   * Appends a message to a client's frame. The frame is rebuilt in a buffer
+   * reserved outside the lock, so that nothing is allocated while it is held.
+   */
+  void add(int slot, const String &msg) {
+    String next;
+    unsigned int reserved = 0;
+    for (;;) {
+      THING_LOCK(lock);
+      String &frame = frames[slot];
+      unsigned int length = frame.length() + 1 + msg.length();
+      if (length <= reserved) {
+        next = frame;
+        next += frame.length() == 0 ? '[' : ',';
+        next += msg;
+        thingSwap(frame, next);
+        THING_UNLOCK(lock);
+        return;
+      }
+      THING_UNLOCK(lock);
+      // Room for a message added meanwhile, too
+      reserved = length + msg.length();
+      next.reserve(reserved);
+    }
+  }
+
+  void clear(int slot) {
+    String dropped;
+    THING_LOCK(lock);
+    thingSwap(dropped, frames[slot]);
+    THING_UNLOCK(lock);
+  }
+
+  /**
+   * Sends every client its pending frame. Returns the number of frames
+   * dropped because the client's queue was full.
+   */
+  uint32_t flush(AsyncWebSocket *ws, ThingClientTable &clients) {
+    uint32_t dropped = 0;
+    for (int slot = 0; slot < WS_MAX_CLIENTS; slot++) {
+      // Take the frame so that the client can be sent to outside the lock
+      String frame;
+      THING_LOCK(lock);
+      thingSwap(frame, frames[slot]);
+      THING_UNLOCK(lock);
+      if (frame.length() == 0) {
+        continue;
+      }
+
+      AsyncWebSocketClient *client = nullptr;
+      uint32_t id;
+      if (clients.idOf(slot, &id)) {
+        client = ws->client(id);
+      }
+
+      if (client == nullptr || client->status() != WS_CONNECTED) {
+        // Client went away before its frame could be sent
+      } else if (client->queueLen() >= WS_CLIENT_QUEUE_HARD_LIMIT) {
+        dropped++;
+      } else {
+        frame += ']';
+        client->text(frame);
+      }
+    }
+    return dropped;
+  }
+};
+
+#ifdef WITH_WS_MULTIPLEX
+#ifndef WS_MULTIPLEX_PATH
+#define WS_MULTIPLEX_PATH "/things"
+#endif
+
+/**
+ * WebSocket endpoint shared by all devices of an adapter. Messages carry the
+ * id of the thing they refer to and everything queued for a client between
+ * two calls to flush() is sent as one frame.
+ */
+class ThingMultiplexSocket {
+public:
+  AsyncWebSocket *ws = nullptr;
+  ThingClientTable clients;
+  ThingOutbox outbox;
+  // frames not sent because a client's queue was full
+  uint32_t droppedMessages = 0;
+
+  void queue(int slot, const String &msg) { outbox.add(slot, msg); }
+
+  void queueAll(const String &msg) {
+    ThingClientMask ready = clients.ready();
+    for (int slot = 0; ready != 0; slot++, ready >>= 1) {
+      if (ready & 1) {
+        outbox.add(slot, msg);
+      }
+    }
+  }
+
+  void flush() { droppedMessages += outbox.flush(ws, clients); }
+};
+#endif
+#endif
+
+#if defined(WITH_SSE) || defined(WITH_WS_RESUME)
+#define WITH_MESSAGE_LOG 1
+#endif
+
+#ifdef WITH_MESSAGE_LOG
+// Number of recent outbound messages kept per device for resuming streams
+#ifndef MESSAGE_LOG_SIZE
+#define MESSAGE_LOG_SIZE 8
+#endif
+
+class ThingItem;
+
+/**
+ * Ring of the most recent outbound messages of a device, numbered with a
+ * sequence that starts at 1.
+ */
+class ThingMessageLog {
+public:
+  struct Entry {
+    uint32_t seq = 0;
+    const char *type = nullptr;
+    String data;
+    // Event an "event" message was sent for
+    ThingItem *event = nullptr;
+  };
+
+  Entry entries[MESSAGE_LOG_SIZE];
+  // Highest seq added, and highest handed out by reserve()
+  uint32_t lastSeq = 0;
+  uint32_t reservedSeq = 0;
+  // Messages are added from the network task as well as from update()
+  ThingLock lock = THING_LOCK_INITIALIZER;
+
+  /**
+   * Hands out the seq of the next message, which is then stamped into the
+   * message and passed to add().
+   */
+  uint32_t reserve() {
+    THING_LOCK(lock);
+    uint32_t seq = ++reservedSeq;
+    THING_UNLOCK(lock);
+    return seq;
+  }
+
+  void add(uint32_t seq, const char *type, const String &data,
+           ThingItem *event = nullptr) {
+    // Copied before and freed after the lock, only buffers move inside it
+    String stored(data);
+    THING_LOCK(lock);
+    Entry &entry = entries[seq % MESSAGE_LOG_SIZE];
+    entry.seq = seq;
+    entry.type = type;
+    thingSwap(entry.data, stored);
+    entry.event = event;
+    if (seq > lastSeq) {
+      lastSeq = seq;
+    }
+    THING_UNLOCK(lock);
+  }
+
+#ifdef WITH_STATIC_ALLOCATION
+  /** Reserves the entries up front, which the adapters do in begin(). */
+  void reserveBuffers() {
+    for (Entry &entry : entries) {
+      entry.data.reserve(MESSAGE_LOG_ENTRY_SIZE);
+    }
+  }
+
+  /**
+   * Serializes message straight into its entry. A message longer than
+   * MESSAGE_LOG_ENTRY_SIZE is left out, which readers find as a gap.
+   */
+  void add(uint32_t seq, const char *type, const JsonDocument &message,
+           ThingItem *event = nullptr) {
+    bool fits = measureJson(message) <= MESSAGE_LOG_ENTRY_SIZE;
+    THING_LOCK(lock);
+    Entry &entry = entries[seq % MESSAGE_LOG_SIZE];
+    entry.seq = fits ? seq : 0;
+    entry.type = type;
+    entry.data = "";
+    if (fits) {
+      serializeJson(message, entry.data);
+    }
+    entry.event = event;
+    if (seq > lastSeq) {
+      lastSeq = seq;
+    }
+    THING_UNLOCK(lock);
+  }
+#endif
+
+  uint32_t firstSeq() {
+    return lastSeq > MESSAGE_LOG_SIZE ? lastSeq - MESSAGE_LOG_SIZE + 1 : 1;
+  }
+
+  /**
+   * Whether every message after seq is still in the log.
+   */
+  bool canResumeFrom(uint32_t seq) {
+    return seq <= lastSeq && seq + 1 >= firstSeq();
+  }
+
+  /**
+   * Returns the message numbered seq, or nullptr if it is no longer in the
+   * log or was reserved but not added yet.
+   */
+  Entry *find(uint32_t seq) {
+    if (seq == 0 || seq < firstSeq() || seq > lastSeq) {
+      return nullptr;
+    }
+    Entry &entry = entries[seq % MESSAGE_LOG_SIZE];
+    return entry.seq == seq ? &entry : nullptr;
+  }
+
+  /**
+   * Copies the message numbered seq, for readers that may run in parallel
+   * to add(). Returns false if the log does not have it.
+   */
+  bool copy(uint32_t seq, Entry &entry) {
+    THING_LOCK(lock);
+    Entry *found = find(seq);
+    if (found != nullptr) {
+      entry = *found;
+    }
+    THING_UNLOCK(lock);
+    return found != nullptr;
+  }
+};
+#endif
+
 class ThingActionObject {
 private:
   void (*start_fn)(const JsonVariant &);
   void (*cancel_fn)();
+  void (*tick_fn)(ThingActionObject *) = nullptr;
 
 #ifndef WITHOUT_WS
   std::function<void(ThingActionObject *)> notify_fn;
 #endif
 
 public:
+#ifdef WITH_STATIC_ALLOCATION
+  // Kept in the object, so that requesting an action never allocates. The
+  // name is not copied and has to outlive the object, like the id of its
+  // ThingAction or a literal does.
+  const char *name;
+  DynamicJsonDocument *actionRequest = nullptr;
+  FixedString<TIMESTAMP_LENGTH> timeRequested;
+  FixedString<TIMESTAMP_LENGTH> timeCompleted;
+  const char *status;
+  FixedString<THING_ACTION_ID_LENGTH> id;
+#else
   String name;
   DynamicJsonDocument *actionRequest = nullptr;
   String timeRequested;
   String timeCompleted;
   String status;
   String id;
+  // Link to this request, set by ThingDevice::requestAction()
+  String href;
+#endif
   ThingActionObject *next = nullptr;
+  // Percentage reported with the status, -1 if not known
+  int progress = -1;
+  // millis() when the action was started
+  unsigned long startedAt = 0;
+#ifdef WITHOUT_WS
+  // Set on every status change, for adapters without notify functions
+  bool statusChanged = false;
+#endif
+#ifdef WITH_DEFERRED_CALLBACKS
+  // Start requested from the network, done in update()
+  bool startRequested = false;
+#endif
+  // Removal requested from the network, done in update() so that the
+  // object is never freed while update() ticks it
+  bool removeRequested = false;
 
   ThingActionObject(const char *name_, DynamicJsonDocument *actionRequest_,
                     void (*start_fn_)(const JsonVariant &),
                     void (*cancel_fn_)())
       : start_fn(start_fn_), cancel_fn(cancel_fn_), name(name_),
-        actionRequest(actionRequest_),
-        timeRequested("1970-01-01T00:00:00+00:00"), status("created") {
+        actionRequest(actionRequest_), status("created") {
+    timeRequested = THING_EPOCH_STRING;
     generateId();
   }
 
+  /**
+   * Creates an asynchronous action. start_fn only sets the work up, after
+   * which tick_fn is called on every update() of the adapter until it calls
+   * complete() or fail(). cancel_fn is called if the action is deleted
+   * while it is running.
+   */
+  ThingActionObject(const char *name_, DynamicJsonDocument *actionRequest_,
+                    void (*start_fn_)(const JsonVariant &),
+                    void (*cancel_fn_)(),
+                    void (*tick_fn_)(ThingActionObject *))
+      : ThingActionObject(name_, actionRequest_, start_fn_, cancel_fn_) {
+    tick_fn = tick_fn_;
+  }
+
 #ifndef WITHOUT_WS
   void setNotifyFunction(std::function<void(ThingActionObject *)> notify_fn_) {
     notify_fn = notify_fn_;
@@ -83,7 +1010,8 @@ public:
 #endif
 
   void generateId() {
-    for (uint8_t i = 0; i < 16; ++i) {
+    char chars[THING_ACTION_ID_LENGTH + 1];
+    for (uint8_t i = 0; i < THING_ACTION_ID_LENGTH; ++i) {
       char c = (char)random('0', 'g');
 
       if (c > '9' && c < 'a') {
@@ -91,11 +1019,13 @@ public:
         continue;
       }
 
-      id += c;
+      chars[i] = c;
     }
+    chars[THING_ACTION_ID_LENGTH] = '\0';
+    id = chars;
   }
 
-  void serialize(JsonObject obj, String deviceId) {
+  void serialize(JsonObject obj, const String &deviceId) {
     JsonObject data = obj.createNestedObject(name);
 
     JsonObject actionObj = actionRequest->as<JsonObject>();
@@ -103,47 +1033,142 @@ public:
     data["input"] = inner["input"];
 
     data["status"] = status;
-    data["timeRequested"] = timeRequested;
+    data["timeRequested"] = timeRequested.c_str();
+
+    if (progress >= 0) {
+      data["progress"] = progress;
+    }
 
     if (timeCompleted != "") {
-      data["timeCompleted"] = timeCompleted;
+      data["timeCompleted"] = timeCompleted.c_str();
     }
 
-    data["href"] = "/things/" + deviceId + "/actions/" + name + "/" + id;
+#ifdef WITH_STATIC_ALLOCATION
+    thingSetPath(data["href"], "/things/", deviceId.c_str(), "/actions/",
+                 name, "/", id.c_str());
+#else
+    if (href != "") {
+      data["href"] = href.c_str();
+    } else {
+      data["href"] = "/things/" + deviceId + "/actions/" + name + "/" + id;
+    }
+#endif
   }
 
   void setStatus(const char *s) {
     status = s;
+    notify();
+  }
 
-#ifndef WITHOUT_WS
-    if (notify_fn != nullptr) {
-      notify_fn(this);
-    }
-#endif
+  JsonVariant getInput() {
+    JsonObject actionObj = actionRequest->as<JsonObject>();
+    JsonObject inner = actionObj[name];
+    return inner["input"];
   }
 
   void start() {
+    startedAt = millis();
+    running = true;
     setStatus("pending");
 
-    JsonObject actionObj = actionRequest->as<JsonObject>();
-    JsonObject inner = actionObj[name];
-    start_fn(inner["input"]);
+    if (start_fn != nullptr) {
+      start_fn(getInput());
+    }
+
+    if (tick_fn == nullptr) {
+      finish();
+    }
+  }
+
+  /**
+   * Starts the action, or with WITH_DEFERRED_CALLBACKS has it started from
+   * the adapter's update(). Used by the adapters' request handlers.
+   */
+  void requestStart() {
+#ifdef WITH_DEFERRED_CALLBACKS
+    startRequested = true;
+#else
+    start();
+#endif
+  }
+
+  /**
+   * Drives an asynchronous action, called from the adapter's update().
+   */
+  void tick() {
+    if (running && tick_fn != nullptr) {
+      tick_fn(this);
+    }
+  }
+
+  bool isRunning() { return running; }
+
+  /** Whether the action completed or failed. */
+  bool isFinished() { return !running && timeCompleted != ""; }
 
-    finish();
+  void setProgress(int percent) {
+    progress = percent;
+    notify();
   }
 
   void cancel() {
-    if (cancel_fn != nullptr) {
+    if (cancel_fn != nullptr && (running || tick_fn == nullptr)) {
       cancel_fn();
     }
+    running = false;
+  }
+
+  void complete() { finish(); }
+
+#ifdef WITH_STATIC_ALLOCATION
+  // Taken from a slab of ACTION_POOL_SIZE objects, new returns nullptr once
+  // it is exhausted
+  static void *operator new(size_t size) noexcept;
+  static void operator delete(void *ptr) noexcept;
+#endif
+
+  void fail() {
+    running = false;
+    timeCompleted = THING_EPOCH_STRING;
+    setStatus("failed");
   }
 
   void finish() {
-    timeCompleted = "1970-01-01T00:00:00+00:00";
+    running = false;
+    timeCompleted = THING_EPOCH_STRING;
     setStatus("completed");
   }
+
+private:
+  bool running = false;
+
+  void notify() {
+#ifndef WITHOUT_WS
+    if (notify_fn != nullptr) {
+      notify_fn(this);
+    }
+#else
+    statusChanged = true;
+#endif
+  }
 };
 
+#ifdef WITH_STATIC_ALLOCATION
+inline ThingSlab<sizeof(ThingActionObject), ACTION_POOL_SIZE> &
+thingActionSlab() {
+  static ThingSlab<sizeof(ThingActionObject), ACTION_POOL_SIZE> slab;
+  return slab;
+}
+
+inline void *ThingActionObject::operator new(size_t size) noexcept {
+  return thingActionSlab().allocate(size);
+}
+
+inline void ThingActionObject::operator delete(void *ptr) noexcept {
+  thingActionSlab().release(ptr);
+}
+#endif
+
 class ThingAction {
 private:
   ThingActionObject *(*generator_fn)(DynamicJsonDocument *);
@@ -154,6 +1179,11 @@ public:
   String description;
   String type;
   JsonObject *input;
+  // Alternatives to title and description kept in flash
+  const __FlashStringHelper *flashTitle = nullptr;
+  const __FlashStringHelper *flashDescription = nullptr;
+  // Link to the action, set by ThingDevice::addAction()
+  String href;
   ThingAction *next = nullptr;
 
   ThingAction(const char *id_,
@@ -174,17 +1204,28 @@ public:
     return generator_fn(actionRequest);
   }
 
-  void serialize(JsonObject obj, String deviceId) {
-    if (title != "") {
-      obj["title"] = title;
+  /** Keeps the title in flash instead of RAM, e.g. setTitle(F("Fade")). */
+  void setTitle(const __FlashStringHelper *title_) { flashTitle = title_; }
+
+  void setDescription(const __FlashStringHelper *description_) {
+    flashDescription = description_;
+  }
+
+  void serialize(JsonObject obj, const String &deviceId) {
+    if (flashTitle != nullptr) {
+      obj["title"] = flashTitle;
+    } else if (title != "") {
+      obj["title"] = title.c_str();
     }
 
-    if (description != "") {
-      obj["description"] = description;
+    if (flashDescription != nullptr) {
+      obj["description"] = flashDescription;
+    } else if (description != "") {
+      obj["description"] = description.c_str();
     }
 
     if (type != "") {
-      obj["@type"] = type;
+      obj["@type"] = type.c_str();
     }
 
     if (input != nullptr) {
@@ -199,7 +1240,114 @@ public:
     // implied default rel=action.)
     JsonArray inline_links = obj.createNestedArray("links");
     JsonObject inline_links_prop = inline_links.createNestedObject();
-    inline_links_prop["href"] = "/things/" + deviceId + "/actions/" + id;
+    if (href != "") {
+      inline_links_prop["href"] = href.c_str();
+    } else {
+      inline_links_prop["href"] = "/things/" + deviceId + "/actions/" + id;
+    }
+  }
+};
+
+/**
+ * Change counter shared by a device and its properties. Every value change
+ * takes the next version, so a version identifies a state of the device.
+ */
+class ThingVersion {
+public:
+  uint32_t current = 0;
+  // Nesting depth of ThingDevice::beginUpdate(), values set by the sketch
+  // are staged while it is not zero
+  uint8_t openUpdates = 0;
+#ifdef ESP32
+  // Odd while a commit sets several values, see beginRead()
+  uint32_t commitSeq = 0;
+#endif
+
+  uint32_t next() {
+#ifdef WITH_THREAD_SAFE_VALUES
+    return __atomic_add_fetch(&current, 1, __ATOMIC_RELAXED);
+#else
+    return ++current;
+#endif
+  }
+
+  void openUpdate() {
+#ifdef ESP32
+    __atomic_add_fetch(&openUpdates, 1, __ATOMIC_ACQ_REL);
+#else
+    openUpdates++;
+#endif
+  }
+
+  /**
+   * Closes an update opened with openUpdate(). Returns true if it was the
+   * outermost one.
+   */
+  bool closeUpdate() {
+#ifdef ESP32
+    uint8_t open = __atomic_load_n(&openUpdates, __ATOMIC_ACQUIRE);
+    do {
+      if (open == 0) {
+        return false;
+      }
+    } while (!__atomic_compare_exchange_n(&openUpdates, &open, open - 1, false,
+                                          __ATOMIC_ACQ_REL,
+                                          __ATOMIC_ACQUIRE));
+    return open == 1;
+#else
+    if (openUpdates == 0) {
+      return false;
+    }
+    return --openUpdates == 0;
+#endif
+  }
+
+  bool isUpdating() {
+#ifdef ESP32
+    return __atomic_load_n(&openUpdates, __ATOMIC_ACQUIRE) > 0;
+#else
+    return openUpdates > 0;
+#endif
+  }
+
+  /** Brackets a commit of several values, called under the device lock. */
+  void beginCommit() {
+#ifdef ESP32
+    __atomic_store_n(&commitSeq, commitSeq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+  }
+
+  void endCommit() {
+#ifdef ESP32
+    __atomic_store_n(&commitSeq, commitSeq + 1, __ATOMIC_RELEASE);
+#endif
+  }
+
+  /**
+   * Starts reading several values, waiting for a commit on another task to
+   * finish. endRead() then returns false if a commit ran meanwhile, in which
+   * case the values have to be read again.
+   */
+  uint32_t beginRead() {
+#ifdef ESP32
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&commitSeq, __ATOMIC_ACQUIRE)) & 1) {
+    }
+    return seq;
+#else
+    return 0;
+#endif
+  }
+
+  bool endRead(uint32_t seq) {
+#ifdef ESP32
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&commitSeq, __ATOMIC_RELAXED) == seq;
+#else
+    (void)seq;
+    return true;
+#endif
   }
 };
 
@@ -214,22 +1362,129 @@ public:
   bool readOnly = false;
   String unit = "";
   String title = "";
+  // Alternatives to description, title and unit kept in flash
+  const __FlashStringHelper *flashDescription = nullptr;
+  const __FlashStringHelper *flashTitle = nullptr;
+  const __FlashStringHelper *flashUnit = nullptr;
   double minimum = 0;
   double maximum = -1;
   double multipleOf = -1;
+  // Link to the item, set when it is added to a device
+  String href;
+  // Device version of the last change to the value
+  uint32_t version = 0;
+  ThingVersion *deviceVersion = nullptr;
+  // Clients receiving changes of this item, counted by the adapter
+  uint16_t watchers = 0;
+#ifndef WITHOUT_WS
+  // Lagging clients that still need to be sent the current value
+  ThingClientMask pendingClients = 0;
+#endif
 
   ThingItem(const char *id_, const char *description_, ThingDataType type_,
             const char *atType_)
       : id(id_), description(description_), type(type_), atType(atType_) {}
 
+  ThingItem(const char *id_, const __FlashStringHelper *description_,
+            ThingDataType type_, const char *atType_)
+      : id(id_), type(type_), atType(atType_),
+        flashDescription(description_) {}
+
+  ~ThingItem() { delete stagedString; }
+
+  // Items own their staged string and are linked into a device
+  ThingItem(const ThingItem &) = delete;
+  ThingItem &operator=(const ThingItem &) = delete;
+
+  /**
+   * Sets the value from the sketch. Between ThingDevice::beginUpdate() and
+   * commitUpdate() it is staged instead.
+   */
   void setValue(ThingDataValue newValue) {
+    if (isStaging()) {
+      stageValue(newValue);
+      return;
+    }
+    applyValue(newValue);
+  }
+
+  void setValue(const char *s) {
+    if (isStaging()) {
+      stageValue(s);
+      return;
+    }
+    applyValue(s);
+  }
+
+  /**
+   * Sets the value right away, even while the sketch has an update open.
+   * Used for writes from clients, whose callback is called next.
+   */
+  void applyValue(ThingDataValue newValue) {
+    beginWrite();
     this->value = newValue;
     this->hasChanged = true;
+    touch();
+    endWrite();
   }
 
-  void setValue(const char *s) {
-    *(this->getValue().string) = s;
+  void applyValue(const char *s) {
+    // Built before taking the lock, so that nothing is allocated under it
+    String next(s);
+    beginWrite();
+    storeString(next);
+    this->hasChanged = true;
+    touch();
+    endWrite();
+  }
+
+  /** Holds back a value until commitStaged(). */
+  void stageValue(ThingDataValue newValue) {
+    this->stagedValue = newValue;
+    this->staged = true;
+  }
+
+  void stageValue(const char *s) {
+    if (stagedString == nullptr) {
+      stagedString = new String();
+    }
+    *stagedString = s;
+    this->staged = true;
+  }
+
+  bool isStaged() { return staged; }
+
+  /**
+   * Makes a value staged during ThingDevice::beginUpdate() visible under the
+   * given version. Returns whether there was one.
+   */
+  bool commitStaged(uint32_t newVersion) {
+    if (!staged) {
+      return false;
+    }
+
+    this->staged = false;
+    commitValue(stagedValue, stagedString, newVersion);
+    return true;
+  }
+
+  /**
+   * Sets a value under the given version, for commits of several values.
+   * A STRING value is taken from string, which is left with the old one.
+   */
+  void commitValue(ThingDataValue newValue, String *string,
+                   uint32_t newVersion) {
+    beginWrite();
+    if (type == STRING && string != nullptr) {
+      storeString(*string);
+    } else {
+      this->value = newValue;
+    }
     this->hasChanged = true;
+    this->version = newVersion;
+    this->updatedAt = millis();
+    this->hasValue = true;
+    endWrite();
   }
 
   /**
@@ -237,14 +1492,64 @@ public:
    * since the last call or returns a nullptr.
    */
   ThingDataValue *changedValueOrNull() {
+#ifdef WITH_THREAD_SAFE_VALUES
+    THING_LOCK(valueLock);
+#endif
     ThingDataValue *v = this->hasChanged ? &this->value : nullptr;
     this->hasChanged = false;
+#ifdef WITH_THREAD_SAFE_VALUES
+    THING_UNLOCK(valueLock);
+#endif
     return v;
   }
 
-  ThingDataValue getValue() { return this->value; }
+  ThingDataValue getValue() {
+#ifdef WITH_THREAD_SAFE_VALUES
+    // Seqlock read: retry if a write started or ended meanwhile instead of
+    // blocking the writer
+    ThingDataValue v;
+    uint32_t seq;
+    do {
+      seq = __atomic_load_n(&valueSeq, __ATOMIC_ACQUIRE);
+      v = this->value;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&valueSeq, __ATOMIC_RELAXED));
+    return v;
+#else
+    return this->value;
+#endif
+  }
 
-  void serialize(JsonObject obj, String deviceId, String resourceType) {
+  /**
+   * Returns a copy of a STRING value, which unlike the String behind
+   * getValue() is safe to use while another task may set the value.
+   */
+  String getStringValue() {
+    String copy;
+#ifdef WITH_THREAD_SAFE_VALUES
+    // Grows the copy outside the lock, so that filling it under the lock
+    // never allocates, and tries again if the value grew meanwhile
+    unsigned int reserved = 0;
+    for (;;) {
+      THING_LOCK(valueLock);
+      unsigned int length = stringLength();
+      if (length <= reserved) {
+        loadString(copy);
+        THING_UNLOCK(valueLock);
+        return copy;
+      }
+      THING_UNLOCK(valueLock);
+      copy.reserve(length);
+      reserved = length;
+    }
+#else
+    loadString(copy);
+    return copy;
+#endif
+  }
+
+  void serialize(JsonObject obj, const String &deviceId,
+                 const char *resourceType) {
     switch (type) {
     case NO_STATE:
       break;
@@ -266,16 +1571,22 @@ public:
       obj["readOnly"] = true;
     }
 
-    if (unit != "") {
-      obj["unit"] = unit;
+    if (flashUnit != nullptr) {
+      obj["unit"] = flashUnit;
+    } else if (unit != "") {
+      obj["unit"] = unit.c_str();
     }
 
-    if (title != "") {
-      obj["title"] = title;
+    if (flashTitle != nullptr) {
+      obj["title"] = flashTitle;
+    } else if (title != "") {
+      obj["title"] = title.c_str();
     }
 
-    if (description != "") {
-      obj["description"] = description;
+    if (flashDescription != nullptr) {
+      obj["description"] = flashDescription;
+    } else if (description != "") {
+      obj["description"] = description.c_str();
     }
 
     if (minimum < maximum) {
@@ -291,7 +1602,7 @@ public:
     }
 
     if (atType != nullptr) {
-      obj["@type"] = atType;
+      obj["@type"] = atType.c_str();
     }
 
     // 2.9 Property object: A links array (An array of Link objects linking
@@ -299,47 +1610,209 @@ public:
     // implied default rel=property.)
     JsonArray inline_links = obj.createNestedArray("links");
     JsonObject inline_links_prop = inline_links.createNestedObject();
-    inline_links_prop["href"] =
-        "/things/" + deviceId + "/" + resourceType + "/" + id;
+    if (href != "") {
+      inline_links_prop["href"] = href.c_str();
+    } else {
+      inline_links_prop["href"] =
+          "/things/" + deviceId + "/" + resourceType + "/" + id;
+    }
+  }
+
+  /**
+   * Keep metadata in flash instead of RAM, e.g. setTitle(F("Brightness")).
+   * It is copied into a document only while that is being serialized.
+   */
+  void setDescription(const __FlashStringHelper *description_) {
+    flashDescription = description_;
+  }
+
+  void setTitle(const __FlashStringHelper *title_) { flashTitle = title_; }
+
+  void setUnit(const __FlashStringHelper *unit_) { flashUnit = unit_; }
+
+  /**
+   * Lets the adapter sample the value on demand instead of the sketch
+   * updating it continuously. sample_fn is expected to call setValue() and
+   * is called from update() while the item is watched, or has no value
+   * yet, and its value is older than ttl milliseconds.
+   */
+  void setSampler(void (*sample_fn_)(), unsigned long ttl_) {
+    sample_fn = sample_fn_;
+    ttl = ttl_;
+  }
+
+  /**
+   * Calls watch_fn with true once anybody follows this item, through a
+   * WebSocket, event stream or recent HTTP read, and with false once nobody
+   * does anymore, so that sketches can slow down or stop sampling.
+   */
+  void setWatchCallback(void (*watch_fn_)(bool)) { watch_fn = watch_fn_; }
+
+  bool isWatched() {
+    return watchers > 0 || millisSinceRead() < WATCH_READ_TIMEOUT;
+  }
+
+  /**
+   * Time since the last read through the HTTP API, or the largest value if
+   * there was none.
+   */
+  unsigned long millisSinceRead() {
+    return wasRead ? millis() - readAt : (unsigned long)-1;
+  }
+
+  void markRead() {
+    readAt = millis();
+    wasRead = true;
+  }
+
+  void setWatchers(uint16_t count) {
+    watchers = count;
+    bool nowWatched = isWatched();
+    if (nowWatched != watched) {
+      watched = nowWatched;
+      if (watch_fn != nullptr) {
+        watch_fn(watched);
+      }
+    }
+  }
+
+  void serializeValue(JsonObject prop) { writeValue(prop); }
+
+  /**
+   * Calls the sampler if the value is due, see setSampler(). Only called
+   * from update(), so that sketch code never runs in a request handler.
+   */
+  void sample() {
+    if (!needsSample() || (hasValue && !isWatched())) {
+      return;
+    }
+
+    sample_fn();
   }
 
-  void serializeValue(JsonObject prop) {
+  /** Whether the value is missing or older than the sampler's ttl. */
+  bool needsSample() {
+    return sample_fn != nullptr && (!hasValue || millis() - updatedAt >= ttl);
+  }
+
+protected:
+#ifdef WITH_THREAD_SAFE_VALUES
+  // Serializes writers, and guards STRING values and hasChanged
+  ThingLock valueLock = THING_LOCK_INITIALIZER;
+#endif
+
+  /** Adds the value to prop. */
+  void writeValue(JsonObject prop) {
     switch (this->type) {
     case NO_STATE:
       break;
     case BOOLEAN:
-      prop[this->id] = this->getValue().boolean;
+      prop[this->id.c_str()] = this->getValue().boolean;
       break;
     case NUMBER:
-      prop[this->id] = this->getValue().number;
+      prop[this->id.c_str()] = this->getValue().number;
       break;
     case INTEGER:
-      prop[this->id] = this->getValue().integer;
+      prop[this->id.c_str()] = this->getValue().integer;
       break;
     case STRING:
-      prop[this->id] = *this->getValue().string;
+#ifdef WITH_THREAD_SAFE_VALUES
+      // Copied out first, so that the document is filled outside the lock
+      prop[this->id.c_str()] = this->getStringValue();
+#else
+      prop[this->id.c_str()] = *this->value.string;
+#endif
       break;
     }
   }
 
+  /**
+   * Sets a STRING value, called while writers are locked out. It takes the
+   * buffer of next, which already holds the new value, and leaves the old
+   * one in next to be freed after unlocking.
+   */
+  void storeString(String &next) { thingSwap(*this->value.string, next); }
+
+  /** Copies a STRING value, called while writers are locked out. */
+  void loadString(String &copy) { copy = *this->value.string; }
+
+  unsigned int stringLength() { return this->value.string->length(); }
+
 private:
   ThingDataValue value = {false};
   bool hasChanged = false;
+  ThingDataValue stagedValue = {false};
+  String *stagedString = nullptr;
+  bool staged = false;
+  void (*sample_fn)() = nullptr;
+  unsigned long ttl = 0;
+  unsigned long updatedAt = 0;
+  bool hasValue = false;
+  void (*watch_fn)(bool) = nullptr;
+  unsigned long readAt = 0;
+  bool wasRead = false;
+  bool watched = false;
+#ifdef WITH_THREAD_SAFE_VALUES
+  // Odd while a write is in progress, see getValue()
+  uint32_t valueSeq = 0;
+#endif
+
+  void beginWrite() {
+#ifdef WITH_THREAD_SAFE_VALUES
+    THING_LOCK(valueLock);
+    __atomic_store_n(&valueSeq, valueSeq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+#endif
+  }
+
+  void endWrite() {
+#ifdef WITH_THREAD_SAFE_VALUES
+    __atomic_store_n(&valueSeq, valueSeq + 1, __ATOMIC_RELEASE);
+    THING_UNLOCK(valueLock);
+#endif
+  }
+
+  bool isStaging() {
+    return deviceVersion != nullptr && deviceVersion->isUpdating();
+  }
+
+  void touch() {
+    updatedAt = millis();
+    hasValue = true;
+    version = deviceVersion != nullptr ? deviceVersion->next() : version + 1;
+  }
 };
 
 class ThingProperty : public ThingItem {
 private:
   void (*callback)(ThingPropertyValue);
+#ifdef WITH_ISR_VALUES
+  ThingDataValue isrValue = {false};
+  volatile bool isrPending = false;
+  ThingLock isrLock = THING_LOCK_INITIALIZER;
+#endif
 
 public:
   const char **propertyEnum = nullptr;
+#ifdef WITH_DEFERRED_CALLBACKS
+  // Latest network write not yet applied, guarded by the device's lock
+  ThingDataValue deferredValue = {false};
+  String *deferredString = nullptr;
+  bool deferred = false;
+#endif
 
   ThingProperty(const char *id_, const char *description_, ThingDataType type_,
                 const char *atType_,
                 void (*callback_)(ThingPropertyValue) = nullptr)
       : ThingItem(id_, description_, type_, atType_), callback(callback_) {}
 
-  void serialize(JsonObject obj, String deviceId, String resourceType) {
+  ThingProperty(const char *id_, const __FlashStringHelper *description_,
+                ThingDataType type_, const char *atType_,
+                void (*callback_)(ThingPropertyValue) = nullptr)
+      : ThingItem(id_, description_, type_, atType_), callback(callback_) {}
+
+  void serialize(JsonObject obj, const String &deviceId,
+                 const char *resourceType) {
     ThingItem::serialize(obj, deviceId, resourceType);
 
     const char **enumVal = propertyEnum;
@@ -360,63 +1833,99 @@ public:
       callback(newValue);
     }
   }
+
+#ifdef WITH_ISR_VALUES
+  // Values set from an interrupt handler that were replaced by a later one
+  // before update() applied them
+  volatile uint32_t coalescedISRValues = 0;
+
+  /**
+   * Sets a BOOLEAN, NUMBER or INTEGER value from an interrupt handler. It
+   * is applied, and the callback called, on the adapter's next update().
+   */
+  void THING_ISR_ATTR setValueFromISR(ThingDataValue newValue) {
+    THING_LOCK_ISR(isrLock);
+    if (isrPending) {
+      coalescedISRValues++;
+    }
+    isrValue = newValue;
+    isrPending = true;
+    THING_UNLOCK_ISR(isrLock);
+  }
+
+  void applyISRValue() {
+    if (!isrPending) {
+      return;
+    }
+
+    THING_BLOCK_ISR(isrLock);
+    ThingDataValue value = isrValue;
+    isrPending = false;
+    THING_UNBLOCK_ISR(isrLock);
+
+    applyValue(value);
+    changed(value);
+  }
+#endif
 };
 
-#ifndef WITHOUT_WS
-class EventSubscription {
+/**
+ * A property of type T: bool, int32_t, float or double, whose value is set
+ * and read as T. It is stored, written into documents and passed to the
+ * callback like that of any ThingProperty of the matching type.
+ *
+ *     ThingPropertyT<float> temperature("temperature", "", nullptr);
+ *     temperature.set(21.5);
+ */
+template <typename T> class ThingPropertyT : public ThingProperty {
 public:
-  uint32_t id;
-  EventSubscription *next;
+  ThingPropertyT(const char *id_, const char *description_,
+                 const char *atType_,
+                 void (*callback_)(ThingPropertyValue) = nullptr)
+      : ThingProperty(id_, description_, ThingDataTraits<T>::type, atType_,
+                      callback_) {}
 
-  EventSubscription(uint32_t id_) : id(id_) {}
+  ThingPropertyT(const char *id_, const __FlashStringHelper *description_,
+                 const char *atType_,
+                 void (*callback_)(ThingPropertyValue) = nullptr)
+      : ThingProperty(id_, description_, ThingDataTraits<T>::type, atType_,
+                      callback_) {}
+
+  void set(T newValue) { setValue(ThingDataTraits<T>::toValue(newValue)); }
+
+  T get() { return ThingDataTraits<T>::fromValue(getValue()); }
+
+#ifdef WITH_ISR_VALUES
+  void THING_ISR_ATTR setFromISR(T newValue) {
+    setValueFromISR(ThingDataTraits<T>::toValue(newValue));
+  }
+#endif
 };
 
+#ifndef WITHOUT_WS
 class ThingEvent : public ThingItem {
-private:
-  EventSubscription *subscriptions = nullptr;
-
 public:
+  // Client slots (see ThingClientTable) subscribed to this event
+  ThingClientMask subscribers = 0;
+#ifdef WITH_WS_MULTIPLEX
+  // Slots of the adapter's multiplexed socket subscribed to this event
+  ThingClientMask muxSubscribers = 0;
+#endif
+
   ThingEvent(const char *id_, const char *description_, ThingDataType type_,
              const char *atType_)
       : ThingItem(id_, description_, type_, atType_) {}
 
-  void addSubscription(uint32_t id) {
-    EventSubscription *sub = new EventSubscription(id);
-    sub->next = subscriptions;
-    subscriptions = sub;
-  }
-
-  void removeSubscription(uint32_t id) {
-    EventSubscription *curr = subscriptions;
-    EventSubscription *prev = nullptr;
-    while (curr != nullptr) {
-      if (curr->id == id) {
-        if (prev == nullptr) {
-          subscriptions = curr->next;
-        } else {
-          prev->next = curr->next;
-        }
-
-        delete curr;
-        return;
-      }
-
-      prev = curr;
-      curr = curr->next;
-    }
-  }
+  ThingEvent(const char *id_, const __FlashStringHelper *description_,
+             ThingDataType type_, const char *atType_)
+      : ThingItem(id_, description_, type_, atType_) {}
 
-  bool isSubscribed(uint32_t id) {
-    EventSubscription *curr = subscriptions;
-    while (curr != nullptr) {
-      if (curr->id == id) {
-        return true;
-      }
+  void addSubscription(int slot) { subscribers |= thingClientBit(slot); }
 
-      curr = curr->next;
-    }
+  void removeSubscription(int slot) { subscribers &= ~thingClientBit(slot); }
 
-    return false;
+  bool isSubscribed(int slot) {
+    return (subscribers & thingClientBit(slot)) != 0;
   }
 };
 #else
@@ -425,23 +1934,60 @@ using ThingEvent = ThingItem;
 
 class ThingEventObject {
 public:
+#ifdef WITH_STATIC_ALLOCATION
+  // Like the name of a ThingActionObject, not copied
+  const char *name;
+  ThingDataType type;
+  ThingDataValue value = {false};
+  FixedString<TIMESTAMP_LENGTH> timestamp;
+#else
   String name;
   ThingDataType type;
   ThingDataValue value = {false};
   String timestamp;
+#endif
   ThingEventObject *next = nullptr;
 
   ThingEventObject(const char *name_, ThingDataType type_,
                    ThingDataValue value_)
-      : name(name_), type(type_), value(value_),
-        timestamp("1970-01-01T00:00:00+00:00") {}
+      : name(name_), type(type_), value(value_) {
+    timestamp = THING_EPOCH_STRING;
+  }
 
   ThingEventObject(const char *name_, ThingDataType type_,
-                   ThingDataValue value_, String timestamp_)
-      : name(name_), type(type_), value(value_), timestamp(timestamp_) {}
+                   ThingDataValue value_, const String &timestamp_)
+      : name(name_), type(type_), value(value_) {
+    timestamp = timestamp_.c_str();
+  }
+
+  /** Creates an event of a bool, int32_t, float or double value. */
+  template <typename T>
+  ThingEventObject(const char *name_, T value_)
+      : ThingEventObject(name_, ThingDataTraits<T>::type,
+                         ThingDataTraits<T>::toValue(value_)) {}
+
+  // Plain integers, whichever of them int32_t is
+  ThingEventObject(const char *name_, int value_)
+      : ThingEventObject(name_, INTEGER, integerValue(value_)) {}
+
+  ThingEventObject(const char *name_, long value_)
+      : ThingEventObject(name_, INTEGER, integerValue(value_)) {}
 
   ThingDataValue getValue() { return this->value; }
 
+  static ThingDataValue integerValue(signed long long v) {
+    ThingDataValue value;
+    value.integer = v;
+    return value;
+  }
+
+#ifdef WITH_STATIC_ALLOCATION
+  // Taken from a slab of EVENT_POOL_SIZE objects, new returns nullptr once
+  // it is exhausted
+  static void *operator new(size_t size) noexcept;
+  static void operator delete(void *ptr) noexcept;
+#endif
+
   void serialize(JsonObject obj) {
     JsonObject data = obj.createNestedObject(name);
     switch (this->type) {
@@ -461,18 +2007,60 @@ public:
       break;
     }
 
-    data["timestamp"] = timestamp;
+    data["timestamp"] = timestamp.c_str();
   }
 };
 
+#ifdef WITH_STATIC_ALLOCATION
+inline ThingSlab<sizeof(ThingEventObject), EVENT_POOL_SIZE> &
+thingEventSlab() {
+  static ThingSlab<sizeof(ThingEventObject), EVENT_POOL_SIZE> slab;
+  return slab;
+}
+
+inline void *ThingEventObject::operator new(size_t size) noexcept {
+  return thingEventSlab().allocate(size);
+}
+
+inline void ThingEventObject::operator delete(void *ptr) noexcept {
+  thingEventSlab().release(ptr);
+}
+#endif
+
 class ThingDevice {
 public:
   String id;
   String title;
   String description;
   const char **type;
+  // "/things/<id>", and the base and WebSocket URLs set by setAddress()
+  String href;
+  String base;
+  String wsHref;
+  // Alternatives to title and description kept in flash
+  const __FlashStringHelper *flashTitle = nullptr;
+  const __FlashStringHelper *flashDescription = nullptr;
 #if !defined(WITHOUT_WS) && (defined(ESP8266) || defined(ESP32))
   AsyncWebSocket *ws = nullptr;
+#endif
+#ifndef WITHOUT_WS
+  ThingClientTable clients;
+  // propertyStatus updates merged into a pending update for a lagging client
+  uint32_t coalescedMessages = 0;
+  // event and actionStatus messages dropped because a client's queue was full
+  uint32_t droppedMessages = 0;
+#endif
+#ifdef WITH_WS_BATCH
+  ThingOutbox outbox;
+#endif
+#ifdef WITH_WS_MULTIPLEX
+  ThingMultiplexSocket *mux = nullptr;
+#endif
+#ifdef WITH_MESSAGE_LOG
+  ThingMessageLog log;
+#endif
+#if defined(WITH_SSE) && (defined(ESP8266) || defined(ESP32))
+  AsyncEventSource *sse = nullptr;
 #endif
   ThingDevice *next = nullptr;
   ThingProperty *firstProperty = nullptr;
@@ -480,60 +2068,441 @@ public:
   ThingActionObject *actionQueue = nullptr;
   ThingEvent *firstEvent = nullptr;
   ThingEventObject *eventQueue = nullptr;
+  ThingVersion version;
+  // Version up to which property changes were pushed to clients
+  uint32_t notifiedVersion = 0;
+  ThingLock lock = THING_LOCK_INITIALIZER;
+  // Request handlers using the action queue, see ThingActionHold
+  uint8_t actionHolds = 0;
+#ifdef WITH_DEFERRED_CALLBACKS
+  // Ring of properties with a deferred write, in order of arrival
+  ThingProperty *deferredWrites[DEFERRED_QUEUE_SIZE];
+  uint8_t deferredHead = 0;
+  uint8_t deferredCount = 0;
+#endif
 
   ThingDevice(const char *_id, const char *_title, const char **_type)
-      : id(_id), title(_title), type(_type) {}
+      : id(_id), title(_title), type(_type), href(String("/things/") + _id) {}
+
+  ThingDevice(const char *_id, const __FlashStringHelper *_title,
+              const char **_type)
+      : id(_id), type(_type), href(String("/things/") + _id),
+        flashTitle(_title) {}
 
   ~ThingDevice() {
 #if !defined(WITHOUT_WS) && (defined(ESP8266) || defined(ESP32))
     if (ws)
       delete ws;
 #endif
+#if defined(WITH_SSE) && (defined(ESP8266) || defined(ESP32))
+    if (sse)
+      delete sse;
+#endif
+  }
+
+#ifdef WITH_MESSAGE_LOG
+  /**
+   * Numbers an outbound message and serializes it into jsonStr, records it
+   * so that streams can be resumed and pushes it to the device's event
+   * stream clients. The seq is reserved before the message is serialized,
+   * so messages published by the network task and by update() at the same
+   * time never share one. With WITH_STATIC_ALLOCATION the message is only
+   * serialized into the log, and jsonStr is left empty.
+   */
+  uint32_t publish(const char *type, JsonDocument &message, String &jsonStr,
+                   ThingItem *event = nullptr) {
+    uint32_t seq = log.reserve();
+#ifdef WITH_WS_RESUME
+    message["seq"] = seq;
+#endif
+#ifdef WITH_STATIC_ALLOCATION
+    // Into the log entry, which was reserved up front, not into jsonStr
+    (void)jsonStr;
+    log.add(seq, type, message, event);
+#else
+    serializeJson(message, jsonStr);
+    log.add(seq, type, jsonStr, event);
+#endif
+#if defined(WITH_SSE) && (defined(ESP8266) || defined(ESP32))
+    if (sse != nullptr && sse->count() > 0) {
+      sse->send(jsonStr.c_str(), type, seq);
+    }
+#endif
+    return seq;
+  }
+
+  /**
+   * Publishes one propertyStatus message for the properties changed since
+   * the last call. Used where no WebSocket update loop consumes changes.
+   */
+  void publishChangedProperties() {
+    ThingJsonLease messageLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &message = *messageLease;
+    message["messageType"] = "propertyStatus";
+    JsonObject prop = message.createNestedObject("data");
+    uint32_t since = notifiedVersion;
+    notifiedVersion = version.current;
+    if (serializeChangedValues(prop, since)) {
+      String jsonStr;
+      publish("propertyStatus", message, jsonStr);
+    }
+  }
+
+  /**
+   * Serializes a propertyStatus message with the value of every property,
+   * for clients that missed more messages than the log holds, into a
+   * String or straight to a client.
+   */
+  template <typename TDestination>
+  void serializePropertySnapshot(TDestination &out) {
+    ThingJsonLease messageLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &message = *messageLease;
+    message["messageType"] = "propertyStatus";
+    JsonObject prop = message.createNestedObject("data");
+    ThingItem *item = firstProperty;
+    while (item != nullptr) {
+      item->serializeValue(prop);
+      item = item->next;
+    }
+#ifdef WITH_WS_RESUME
+    message["seq"] = log.lastSeq;
+#endif
+    serializeJson(message, out);
+  }
+#endif
+
+#ifdef WITH_WS_RESUME
+  /**
+   * Sends a reconnected client the messages after the last seq it received,
+   * or a snapshot of the properties if the log no longer covers the gap.
+   * Events are only replayed if the client subscribed to them again.
+   */
+  void resumeClient(AsyncWebSocketClient *client, uint32_t seq) {
+    int slot = clients.find(client->id());
+    if (!log.canResumeFrom(seq)) {
+      String jsonStr;
+      serializePropertySnapshot(jsonStr);
+      sendMessage(client, slot, jsonStr);
+      return;
+    }
+
+    ThingMessageLog::Entry entry;
+    for (uint32_t next = seq + 1; log.copy(next, entry); next++) {
+      if (entry.event != nullptr &&
+          (slot < 0 || !((ThingEvent *)entry.event)->isSubscribed(slot))) {
+        continue;
+      }
+      sendMessage(client, slot, entry.data);
+    }
   }
+#endif
 
 #ifndef WITHOUT_WS
+  /**
+   * Gives a newly connected client a slot. Returns false if all
+   * WS_MAX_CLIENTS slots are taken, in which case the caller closes it.
+   */
+  bool addClient(uint32_t id) { return clients.attach(id) >= 0; }
+
+  void removeClient(uint32_t id) {
+    int slot = clients.find(id);
+    if (slot < 0) {
+      return;
+    }
+
+    removeEventSubscriptions(id);
+    clients.detach(slot);
+#ifdef WITH_WS_BATCH
+    outbox.clear(slot);
+#endif
+    ThingItem *item = firstProperty;
+    while (item != nullptr) {
+      item->pendingClients &= ~thingClientBit(slot);
+      item = item->next;
+    }
+  }
+
+  /**
+   * Sends a message to a client, or adds it to the client's frame for the
+   * current update() when WITH_WS_BATCH is defined. May be called from
+   * the network task, as the outbox is locked against update().
+   */
+  void sendMessage(AsyncWebSocketClient *client, int slot,
+                   const String &msg) {
+#ifdef WITH_WS_BATCH
+    if (slot >= 0) {
+      outbox.add(slot, msg);
+      return;
+    }
+#else
+    (void)slot;
+#endif
+    client->text(msg);
+  }
+
+  /**
+   * Sends a message that must not be coalesced (events and action statuses)
+   * to a client, dropping it if the client's queue is full.
+   */
+  void sendOrDrop(AsyncWebSocketClient *client, int slot, const String &msg) {
+    if (client->queueLen() >= WS_CLIENT_QUEUE_HARD_LIMIT) {
+      droppedMessages++;
+      return;
+    }
+    sendMessage(client, slot, msg);
+  }
+
+  /**
+   * Sends the messages collected for each client since the last call as one
+   * frame per client.
+   */
+  void flushMessages() {
+#ifdef WITH_WS_BATCH
+    droppedMessages += outbox.flush((AsyncWebSocket *)ws, clients);
+#endif
+  }
+
   void removeEventSubscriptions(uint32_t id) {
+    int slot = clients.find(id);
+    if (slot < 0) {
+      return;
+    }
+
     ThingEvent *event = firstEvent;
     while (event != nullptr) {
-      event->removeSubscription(id);
+      event->removeSubscription(slot);
       event = (ThingEvent *)event->next;
     }
   }
 
-  void addEventSubscription(uint32_t id, String eventName) {
+  void addEventSubscription(uint32_t id, const String &eventName) {
     ThingEvent *event = findEvent(eventName.c_str());
     if (!event) {
       return;
     }
 
-    event->addSubscription(id);
+    int slot = clients.attach(id);
+    if (slot < 0) {
+      return;
+    }
+
+    event->addSubscription(slot);
   }
+#endif
 
+#if !defined(WITHOUT_WS) || defined(WITH_MESSAGE_LOG)
   void sendActionStatus(ThingActionObject *action) {
-    DynamicJsonDocument message(LARGE_JSON_DOCUMENT_SIZE);
+    ThingJsonLease messageLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &message = *messageLease;
     message["messageType"] = "actionStatus";
     JsonObject prop = message.createNestedObject("data");
     action->serialize(prop, id);
     String jsonStr;
+#ifdef WITH_MESSAGE_LOG
+    publish("actionStatus", message, jsonStr);
+#else
     serializeJson(message, jsonStr);
+#endif
+#ifndef WITHOUT_WS
     // Inform all connected ws clients about action statuses
-    ((AsyncWebSocket *)ws)->textAll(jsonStr);
+    for (AsyncWebSocketClient *client :
+         ((AsyncWebSocket *)ws)->getClients()) {
+      int slot = clients.find(client->id());
+      if (slot >= 0 && client->status() == WS_CONNECTED) {
+        sendOrDrop(client, slot, jsonStr);
+      }
+    }
+#endif
+
+#ifdef WITH_WS_MULTIPLEX
+    if (mux != nullptr && mux->clients.used != 0) {
+      message["id"] = id;
+      jsonStr = "";
+      serializeJson(message, jsonStr);
+      mux->queueAll(jsonStr);
+    }
+#endif
+  }
+#endif
+
+  ThingProperty *findProperty(const char *id) {
+    ThingProperty *p = this->firstProperty;
+    while (p) {
+      if (!strcmp(p->id.c_str(), id))
+        return p;
+      p = (ThingProperty *)p->next;
+    }
+    return nullptr;
+  }
+
+  void addProperty(ThingProperty *property) {
+    property->href = href + "/properties/" + property->id;
+    property->next = firstProperty;
+    property->deviceVersion = &version;
+    property->version = version.current;
+    firstProperty = property;
+  }
+
+  /**
+   * Holds back values set on this device's properties until the matching
+   * commitUpdate(), which makes them visible together under one version so
+   * that readers and clients never see half of an update. Calls may nest.
+   */
+  void beginUpdate() { version.openUpdate(); }
+
+  void commitUpdate() {
+    if (!version.closeUpdate()) {
+      return;
+    }
+
+    // Only the sketch stages values, so they can be looked at unlocked
+    bool changed = false;
+    ThingItem *item = this->firstProperty;
+    while (item != nullptr) {
+      changed |= item->isStaged();
+      item = item->next;
+    }
+    if (!changed) {
+      return;
+    }
+
+    THING_LOCK(lock);
+    version.beginCommit();
+    uint32_t newVersion = version.next();
+    item = this->firstProperty;
+    while (item != nullptr) {
+      item->commitStaged(newVersion);
+      item = item->next;
+    }
+    version.endCommit();
+    THING_UNLOCK(lock);
+  }
+
+  /**
+   * Samples the properties that have a sampler, see ThingItem::sample().
+   */
+  void sampleProperties() {
+    ThingItem *item = this->firstProperty;
+    while (item != nullptr) {
+      item->sample();
+      item = item->next;
+    }
+  }
+
+  /**
+   * Whether a property, or any property if item is null, has a sampler and
+   * a value older than its ttl, which a read should wait for.
+   */
+  bool needsSample(ThingItem *item) {
+    if (item != nullptr) {
+      return item->needsSample();
+    }
+
+    item = this->firstProperty;
+    while (item != nullptr) {
+      if (item->needsSample()) {
+        return true;
+      }
+      item = item->next;
+    }
+    return false;
+  }
+
+  /**
+   * Samples a property, or all properties if item is null, before a read
+   * answered from within update(), so that it does not return a value that
+   * went stale while nobody was watching.
+   */
+  void sampleForRead(ThingItem *item) {
+    markPropertiesRead(item);
+    if (item != nullptr) {
+      item->sample();
+    } else {
+      sampleProperties();
+    }
+  }
+
+  /**
+   * Recounts the clients following each property and event, calling watch
+   * callbacks on changes. streams is the number of event stream clients,
+   * which receive every message of the device.
+   */
+  void updateWatchers(uint16_t streams) {
+    uint16_t propertyWatchers = streams;
+#ifndef WITHOUT_WS
+    propertyWatchers += __builtin_popcount(clients.used);
+#endif
+#ifdef WITH_WS_MULTIPLEX
+    if (mux != nullptr) {
+      propertyWatchers += __builtin_popcount(mux->clients.used);
+    }
+#endif
+    ThingItem *item = this->firstProperty;
+    while (item != nullptr) {
+      item->setWatchers(propertyWatchers);
+      item = item->next;
+    }
+
+    ThingEvent *event = this->firstEvent;
+    while (event != nullptr) {
+      uint16_t eventWatchers = streams;
+#ifndef WITHOUT_WS
+      eventWatchers += __builtin_popcount(event->subscribers & clients.used);
+#endif
+#ifdef WITH_WS_MULTIPLEX
+      if (mux != nullptr) {
+        eventWatchers +=
+            __builtin_popcount(event->muxSubscribers & mux->clients.used);
+      }
+#endif
+      event->setWatchers(eventWatchers);
+      event = (ThingEvent *)event->next;
+    }
+  }
+
+  /**
+   * Records a read through the HTTP API of a property, or of all properties
+   * if item is null.
+   */
+  void markPropertiesRead(ThingItem *item) {
+    if (item != nullptr) {
+      item->markRead();
+      return;
+    }
+
+    item = this->firstProperty;
+    while (item != nullptr) {
+      item->markRead();
+      item = item->next;
+    }
   }
-#endif
 
-  ThingProperty *findProperty(const char *id) {
-    ThingProperty *p = this->firstProperty;
-    while (p) {
-      if (!strcmp(p->id.c_str(), id))
-        return p;
-      p = (ThingProperty *)p->next;
+  /**
+   * Adds the value of every property changed after the given version to
+   * obj. Returns whether there was any.
+   */
+  bool serializeChangedValues(JsonObject obj, uint32_t since) {
+    bool changed = false;
+    ThingItem *item = this->firstProperty;
+    while (item != nullptr) {
+      if (item->version > since) {
+        item->serializeValue(obj);
+        changed = true;
+      }
+      item = item->next;
     }
-    return nullptr;
+    return changed;
   }
 
-  void addProperty(ThingProperty *property) {
-    property->next = firstProperty;
-    firstProperty = property;
+  /**
+   * Whether a property, or any property if item is null, changed after the
+   * given version.
+   */
+  bool hasChangedSince(ThingItem *item, uint32_t since) {
+    if (item != nullptr) {
+      return item->version > since;
+    }
+    return version.current > since;
   }
 
   ThingAction *findAction(const char *id) {
@@ -549,7 +2518,8 @@ public:
   ThingActionObject *findActionObject(const char *id) {
     ThingActionObject *a = this->actionQueue;
     while (a) {
-      if (!strcmp(a->id.c_str(), id))
+      // One that is being removed is gone for clients already
+      if (!strcmp(a->id.c_str(), id) && !a->removeRequested)
         return a;
       a = a->next;
     }
@@ -557,6 +2527,7 @@ public:
   }
 
   void addAction(ThingAction *action) {
+    action->href = href + "/actions/" + action->id;
     action->next = firstAction;
     firstAction = action;
   }
@@ -571,18 +2542,30 @@ public:
     return nullptr;
   }
 
+  ThingEvent *findEvent(const String &id) { return findEvent(id.c_str()); }
+
   void addEvent(ThingEvent *event) {
+    event->href = href + "/events/" + event->id;
     event->next = firstEvent;
     firstEvent = event;
   }
 
-  void setProperty(const char *name, const JsonVariant &newValue) {
+  /**
+   * Applies a write from a client and calls the property's callback, with
+   * WITH_DEFERRED_CALLBACKS from the adapter's update(). Returns false if
+   * the write was rejected because the deferred queue is full. Unknown
+   * properties are ignored.
+   */
+  bool setProperty(const char *name, const JsonVariant &newValue) {
     ThingProperty *property = findProperty(name);
 
     if (property == nullptr) {
-      return;
+      return true;
     }
 
+#ifdef WITH_DEFERRED_CALLBACKS
+    return deferWrite(property, newValue);
+#else
     switch (property->type) {
     case NO_STATE: {
       break;
@@ -590,32 +2573,224 @@ public:
     case BOOLEAN: {
       ThingDataValue value;
       value.boolean = newValue.as<bool>();
-      property->setValue(value);
+      property->applyValue(value);
       property->changed(value);
       break;
     }
     case NUMBER: {
       ThingDataValue value;
       value.number = newValue.as<double>();
-      property->setValue(value);
+      property->applyValue(value);
       property->changed(value);
       break;
     }
     case INTEGER: {
       ThingDataValue value;
       value.integer = newValue.as<signed long long>();
-      property->setValue(value);
+      property->applyValue(value);
       property->changed(value);
       break;
     }
     case STRING:
-      property->setValue(newValue.as<const char *>());
+      property->applyValue(newValue.as<const char *>());
+      property->changed(property->getValue());
+      break;
+    }
+    return true;
+#endif
+  }
+
+#ifdef WITH_DEFERRED_CALLBACKS
+  /**
+   * Records a write for applyDeferredWrites(). A property is queued once,
+   * later writes replace its pending value. Returns false if the queue is
+   * full, in which case the write is dropped.
+   */
+  bool deferWrite(ThingProperty *property, const JsonVariant &newValue) {
+    ThingDataValue value = {false};
+    String *string = nullptr;
+    switch (property->type) {
+    case NO_STATE:
+      return true;
+    case BOOLEAN:
+      value.boolean = newValue.as<bool>();
+      break;
+    case NUMBER:
+      value.number = newValue.as<double>();
+      break;
+    case INTEGER:
+      value.integer = newValue.as<signed long long>();
+      break;
+    case STRING:
+      // Allocated outside of the critical section
+      string = new String(newValue.as<const char *>());
+      break;
+    }
+
+    THING_LOCK(lock);
+    bool queued = property->deferred;
+    if (!queued && deferredCount < DEFERRED_QUEUE_SIZE) {
+      uint8_t tail = (deferredHead + deferredCount) % DEFERRED_QUEUE_SIZE;
+      deferredWrites[tail] = property;
+      deferredCount++;
+      property->deferred = queued = true;
+    }
+    if (queued) {
+      property->deferredValue = value;
+      String *replaced = property->deferredString;
+      property->deferredString = string;
+      string = replaced;
+    }
+    THING_UNLOCK(lock);
+
+    delete string;
+    return queued;
+  }
+
+  /**
+   * Whether count more writes fit the deferred queue. Writes are only
+   * added by the network task, so this still holds when it makes them.
+   */
+  bool canDeferWrites(size_t count) {
+    THING_LOCK(lock);
+    bool fits = deferredCount + count <= DEFERRED_QUEUE_SIZE;
+    THING_UNLOCK(lock);
+    return fits;
+  }
+
+  /**
+   * Applies deferred writes and calls the property callbacks, called from
+   * the adapter's update().
+   */
+  void applyDeferredWrites() {
+    while (true) {
+      THING_LOCK(lock);
+      if (deferredCount == 0) {
+        THING_UNLOCK(lock);
+        return;
+      }
+      ThingProperty *property = deferredWrites[deferredHead];
+      deferredHead = (deferredHead + 1) % DEFERRED_QUEUE_SIZE;
+      deferredCount--;
+      property->deferred = false;
+      ThingDataValue value = property->deferredValue;
+      String *string = property->deferredString;
+      property->deferredString = nullptr;
+      THING_UNLOCK(lock);
+
+      if (string != nullptr) {
+        property->applyValue(string->c_str());
+        delete string;
+        property->changed(property->getValue());
+      } else {
+        property->applyValue(value);
+        property->changed(value);
+      }
+    }
+  }
+#endif
+
+#ifdef WITH_ISR_VALUES
+  /**
+   * Applies values set from interrupt handlers, called from the adapter's
+   * update().
+   */
+  void applyISRValues() {
+    ThingProperty *property = this->firstProperty;
+    while (property != nullptr) {
+      property->applyISRValue();
+      property = (ThingProperty *)property->next;
+    }
+  }
+#endif
+
+  /**
+   * Sets several properties, which become visible together under one
+   * version, and then calls their callbacks in the order given. Nothing is
+   * changed unless every key names a property of this device.
+   */
+  bool setProperties(JsonObject values) {
+    for (JsonPair kv : values) {
+      if (findProperty(kv.key().c_str()) == nullptr) {
+        return false;
+      }
+    }
+
+#ifdef WITH_DEFERRED_CALLBACKS
+    // Applied together by the next update(), before changes are sent
+    for (JsonPair kv : values) {
+      setProperty(kv.key().c_str(), kv.value());
+    }
+#else
+    // Kept here rather than in the properties, whose staging slots hold the
+    // sketch's open update, and built before taking the lock
+    struct Write {
+      ThingProperty *property;
+      ThingDataValue value;
+      String string;
+    };
+    Write *writes = new Write[values.size()];
+    size_t count = 0;
+    bool changed = false;
+    for (JsonPair kv : values) {
+      Write &write = writes[count++];
+      write.property = findProperty(kv.key().c_str());
+      write.value = readValue(write.property, kv.value());
+      if (write.property->type == STRING) {
+        write.string = kv.value().as<const char *>();
+      }
+      changed |= write.property->type != NO_STATE;
+    }
+
+    if (changed) {
+      THING_LOCK(lock);
+      version.beginCommit();
+      uint32_t newVersion = version.next();
+      for (size_t i = 0; i < count; i++) {
+        if (writes[i].property->type != NO_STATE) {
+          writes[i].property->commitValue(writes[i].value, &writes[i].string,
+                                          newVersion);
+        }
+      }
+      version.endCommit();
+      THING_UNLOCK(lock);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+      ThingProperty *property = writes[i].property;
       property->changed(property->getValue());
+    }
+    // Also frees the strings replaced by the writes
+    delete[] writes;
+#endif
+    return true;
+  }
+
+  /** Converts a value written by a client, other than a STRING. */
+  ThingDataValue readValue(ThingProperty *property,
+                           const JsonVariant &newValue) {
+    ThingDataValue value = {false};
+    switch (property->type) {
+    case NO_STATE:
+    case STRING:
+      break;
+    case BOOLEAN:
+      value.boolean = newValue.as<bool>();
+      break;
+    case NUMBER:
+      value.number = newValue.as<double>();
+      break;
+    case INTEGER:
+      value.integer = newValue.as<signed long long>();
       break;
     }
+    return value;
   }
 
   ThingActionObject *requestAction(DynamicJsonDocument *actionRequest) {
+    if (actionRequest == nullptr) {
+      return nullptr;
+    }
     JsonObject actionObj = actionRequest->as<JsonObject>();
 
     // There should only be one key/value pair
@@ -633,25 +2808,25 @@ public:
     if (obj == nullptr) {
       return nullptr;
     }
+#ifndef WITH_STATIC_ALLOCATION
+    obj->href = action->href + "/" + obj->id;
+#endif
 
     queueActionObject(obj);
     return obj;
   }
 
-  void removeAction(String id) {
+  void removeAction(const String &id) { removeAction(id.c_str()); }
+
+  void removeAction(const char *id) {
     ThingActionObject *curr = actionQueue;
     ThingActionObject *prev = nullptr;
     while (curr != nullptr) {
-      if (curr->id == id) {
-        if (prev == nullptr) {
-          actionQueue = curr->next;
-        } else {
-          prev->next = curr->next;
+      if (!strcmp(curr->id.c_str(), id)) {
+        if (unlinkAction(curr, prev)) {
+          curr->cancel();
+          freeAction(curr);
         }
-
-        curr->cancel();
-        delete curr->actionRequest;
-        delete curr;
         return;
       }
 
@@ -660,56 +2835,281 @@ public:
     }
   }
 
+  /**
+   * Unlinks an action that follows prev, or heads the queue if prev is
+   * nullptr. Returns false and leaves it queued while a request handler
+   * holds the actions, see ThingActionHold.
+   */
+  bool unlinkAction(ThingActionObject *obj, ThingActionObject *prev) {
+    THING_LOCK(lock);
+    if (actionHolds > 0) {
+      THING_UNLOCK(lock);
+      return false;
+    }
+    if (actionQueue == obj) {
+      actionQueue = obj->next;
+    } else {
+      // Actions queued meanwhile by a request handler come before prev
+      ThingActionObject *before = prev != nullptr ? prev : actionQueue;
+      while (before->next != obj) {
+        before = before->next;
+      }
+      before->next = obj->next;
+    }
+    THING_UNLOCK(lock);
+    return true;
+  }
+
+  /** Frees an unlinked action without cancelling it. */
+  void freeAction(ThingActionObject *obj) {
+    thingJsonFree(obj->actionRequest);
+    delete obj;
+  }
+
+  /**
+   * Keeps update() from deleting actions until releaseActions(), while a
+   * request handler on another task uses them. Calls may nest.
+   */
+  void holdActions() {
+    THING_LOCK(lock);
+    actionHolds++;
+    THING_UNLOCK(lock);
+  }
+
+  void releaseActions() {
+    THING_LOCK(lock);
+    actionHolds--;
+    THING_UNLOCK(lock);
+  }
+
+#ifdef WITH_STATIC_ALLOCATION
+  /**
+   * Deletes the oldest finished action, so that the next one can be taken
+   * from the pools. Returns whether there was one.
+   */
+  bool removeOldestFinishedAction() {
+    ThingActionObject *oldest = nullptr;
+    ThingActionObject *oldestPrev = nullptr;
+    ThingActionObject *prev = nullptr;
+    // New actions are queued first, so the oldest one comes last
+    for (ThingActionObject *curr = actionQueue; curr != nullptr;
+         curr = curr->next) {
+      if (curr->isFinished()) {
+        oldest = curr;
+        oldestPrev = prev;
+      }
+      prev = curr;
+    }
+    if (oldest == nullptr || !unlinkAction(oldest, oldestPrev)) {
+      return false;
+    }
+    freeAction(oldest);
+    return true;
+  }
+#endif
+
+  /**
+   * Drives the running asynchronous actions, called from the adapter's
+   * update(). Actions held by a request handler are deleted on a later call.
+   */
+  void tickActions() {
+#ifndef WITHOUT_ACTIONS
+    ThingActionObject *prev = nullptr;
+    ThingActionObject *action = actionQueue;
+    while (action != nullptr) {
+      ThingActionObject *next = action->next;
+      if (action->removeRequested) {
+        if (unlinkAction(action, prev)) {
+          action->cancel();
+          freeAction(action);
+        } else {
+          prev = action;
+        }
+        action = next;
+        continue;
+      }
+#ifdef WITH_DEFERRED_CALLBACKS
+      if (action->startRequested) {
+        action->startRequested = false;
+        action->start();
+      }
+#endif
+      action->tick();
+#if defined(WITHOUT_WS) && defined(WITH_MESSAGE_LOG)
+      if (action->statusChanged) {
+        action->statusChanged = false;
+        sendActionStatus(action);
+      }
+#endif
+#ifdef WITHOUT_ACTION_HISTORY
+      // The final status has been published, nobody asks for it again.
+      // Deleted without cancel(), which would call cancel_fn.
+      if (action->isFinished() && unlinkAction(action, prev)) {
+        freeAction(action);
+        action = next;
+        continue;
+      }
+#endif
+      prev = action;
+      action = next;
+    }
+#endif
+  }
+
   void queueActionObject(ThingActionObject *obj) {
+    THING_LOCK(lock);
     obj->next = actionQueue;
     actionQueue = obj;
+    THING_UNLOCK(lock);
+  }
+
+  /**
+   * Has an action removed by the adapter's update() on behalf of a request
+   * handler, which may run in parallel to update().
+   */
+  void requestRemoveAction(const char *id) {
+    holdActions();
+    ThingActionObject *obj = findActionObject(id);
+    if (obj != nullptr) {
+      obj->removeRequested = true;
+    }
+    releaseActions();
+  }
+
+  /**
+   * Serializes the action with the given id into obj, holding the actions
+   * meanwhile. Returns false if there is none.
+   */
+  bool serializeActionObject(JsonObject obj, const char *actionId) {
+    holdActions();
+    ThingActionObject *action = findActionObject(actionId);
+    if (action != nullptr) {
+      action->serialize(obj, id);
+    }
+    releaseActions();
+    return action != nullptr;
   }
 
   void queueEventObject(ThingEventObject *obj) {
+    if (obj == nullptr) {
+      return;
+    }
+#ifdef WITHOUT_EVENTS
+    // Nothing would ever read it
+    delete obj;
+    return;
+#endif
     obj->next = eventQueue;
     eventQueue = obj;
+#ifdef WITH_STATIC_ALLOCATION
+    trimEventQueue();
+#endif
 
-#ifndef WITHOUT_WS
-    ThingEvent *event = findEvent(obj->name.c_str());
+#if !defined(WITHOUT_WS) || defined(WITH_MESSAGE_LOG)
+    ThingEvent *event = findEvent(obj->name);
     if (!event) {
       return;
     }
 
+#ifndef WITHOUT_WS
+    ThingClientMask subscribers = event->subscribers & clients.used;
+    ThingClientMask muxSubscribers = 0;
+#ifdef WITH_WS_MULTIPLEX
+    if (mux != nullptr) {
+      muxSubscribers = event->muxSubscribers & mux->clients.used;
+    }
+#endif
+#ifndef WITH_MESSAGE_LOG
+    if (subscribers == 0 && muxSubscribers == 0) {
+      return;
+    }
+#endif
+#endif
+
     // * Send events as defined in "4.7 event message"
-    DynamicJsonDocument message(SMALL_JSON_DOCUMENT_SIZE);
+    ThingJsonLease messageLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &message = *messageLease;
     message["messageType"] = "event";
     JsonObject data = message.createNestedObject("data");
     obj->serialize(data);
     String jsonStr;
+#ifdef WITH_MESSAGE_LOG
+    publish("event", message, jsonStr, event);
+#else
     serializeJson(message, jsonStr);
+#endif
 
+#ifndef WITHOUT_WS
     // Inform all subscribed ws clients about events
-    for (AsyncWebSocketClient *client :
-         ((AsyncWebSocket *)this->ws)->getClients()) {
-      uint32_t id = client->id();
+    for (int slot = 0; subscribers != 0; slot++, subscribers >>= 1) {
+      uint32_t clientId;
+      if (!(subscribers & 1) || !clients.idOf(slot, &clientId)) {
+        continue;
+      }
+
+      AsyncWebSocketClient *client =
+          ((AsyncWebSocket *)this->ws)->client(clientId);
+      if (client != nullptr && client->status() == WS_CONNECTED) {
+        sendOrDrop(client, slot, jsonStr);
+      }
+    }
 
-      if (event->isSubscribed(id)) {
-        ((AsyncWebSocket *)this->ws)->text(id, jsonStr);
+#ifdef WITH_WS_MULTIPLEX
+    if (muxSubscribers != 0) {
+      message["id"] = id;
+      jsonStr = "";
+      serializeJson(message, jsonStr);
+      for (int slot = 0; muxSubscribers != 0; slot++, muxSubscribers >>= 1) {
+        if (muxSubscribers & 1) {
+          mux->queue(slot, jsonStr);
+        }
       }
     }
+#endif
+#endif
 #endif
   }
 
-  void serialize(JsonObject descr, String ip, uint16_t port) {
-    descr["id"] = this->id;
-    descr["title"] = this->title;
-    descr["@context"] = "https://webthings.io/schemas";
+  /** Keeps the description in flash instead of RAM. */
+  void setDescription(const __FlashStringHelper *description_) {
+    flashDescription = description_;
+  }
 
-    if (this->description != "") {
-      descr["description"] = this->description;
-    }
+  /**
+   * Sets the address the device is served from, which the adapter knows
+   * once it is constructed, and builds the URLs that depend on it.
+   */
+  void setAddress(const String &ip, uint16_t port) {
+    String host = ip;
     if (port != 80) {
-      char buffer[33];
-      itoa(port, buffer, 10);
-      descr["base"] = "http://" + ip + ":" + buffer + "/";
+      host += ':';
+      host += port;
+    }
+    base = "http://" + host + "/";
+#ifndef WITHOUT_WS
+    wsHref = "ws://" + host + href;
+#endif
+  }
+
+  void serialize(JsonObject descr, const String &ip, uint16_t port) {
+    if (base == "") {
+      setAddress(ip, port);
+    }
+
+    descr["id"] = this->id.c_str();
+    if (flashTitle != nullptr) {
+      descr["title"] = flashTitle;
     } else {
-      descr["base"] = "http://" + ip + "/";
+      descr["title"] = this->title.c_str();
+    }
+    descr["@context"] = "https://webthings.io/schemas";
+
+    if (flashDescription != nullptr) {
+      descr["description"] = flashDescription;
+    } else if (this->description != "") {
+      descr["description"] = this->description.c_str();
     }
+    descr["base"] = base.c_str();
 
     JsonObject securityDefinitions =
         descr.createNestedObject("securityDefinitions");
@@ -728,34 +3128,30 @@ public:
     {
       JsonObject links_prop = links.createNestedObject();
       links_prop["rel"] = "properties";
-      links_prop["href"] = "/things/" + this->id + "/properties";
+      thingSetPath(links_prop["href"], href.c_str(), "/properties");
     }
 
-    {
+#ifndef WITHOUT_ACTIONS
+    if (this->firstAction != nullptr) {
       JsonObject links_prop = links.createNestedObject();
       links_prop["rel"] = "actions";
-      links_prop["href"] = "/things/" + this->id + "/actions";
+      thingSetPath(links_prop["href"], href.c_str(), "/actions");
     }
+#endif
 
-    {
+#ifndef WITHOUT_EVENTS
+    if (this->firstEvent != nullptr) {
       JsonObject links_prop = links.createNestedObject();
       links_prop["rel"] = "events";
-      links_prop["href"] = "/things/" + this->id + "/events";
+      thingSetPath(links_prop["href"], href.c_str(), "/events");
     }
+#endif
 
 #ifndef WITHOUT_WS
     {
       JsonObject links_prop = links.createNestedObject();
       links_prop["rel"] = "alternate";
-
-      if (port != 80) {
-        char buffer[33];
-        itoa(port, buffer, 10);
-        links_prop["href"] =
-            "ws://" + ip + ":" + buffer + "/things/" + this->id;
-      } else {
-        links_prop["href"] = "ws://" + ip + "/things/" + this->id;
-      }
+      links_prop["href"] = wsHref.c_str();
     }
 #endif
 
@@ -763,51 +3159,84 @@ public:
     if (property != nullptr) {
       JsonObject properties = descr.createNestedObject("properties");
       while (property != nullptr) {
-        JsonObject obj = properties.createNestedObject(property->id);
+        JsonObject obj = properties.createNestedObject(property->id.c_str());
         property->serialize(obj, id, "properties");
         property = (ThingProperty *)property->next;
       }
     }
 
+#ifndef WITHOUT_ACTIONS
     ThingAction *action = this->firstAction;
     if (action != nullptr) {
       JsonObject actions = descr.createNestedObject("actions");
       while (action != nullptr) {
-        JsonObject obj = actions.createNestedObject(action->id);
+        JsonObject obj = actions.createNestedObject(action->id.c_str());
         action->serialize(obj, id);
         action = action->next;
       }
     }
+#endif
 
+#ifndef WITHOUT_EVENTS
     ThingEvent *event = this->firstEvent;
     if (event != nullptr) {
       JsonObject events = descr.createNestedObject("events");
       while (event != nullptr) {
-        JsonObject obj = events.createNestedObject(event->id);
+        JsonObject obj = events.createNestedObject(event->id.c_str());
         event->serialize(obj, id, "events");
         event = (ThingEvent *)event->next;
       }
     }
+#endif
+  }
+
+#ifdef WITH_STATIC_ALLOCATION
+  /**
+   * Deletes the events beyond the newest EVENT_QUEUE_SIZE, so that the next
+   * event object can be taken from the slab.
+   */
+  void trimEventQueue() {
+    ThingEventObject *curr = eventQueue;
+    for (int i = 1; curr != nullptr && i < EVENT_QUEUE_SIZE; i++) {
+      curr = curr->next;
+    }
+    if (curr == nullptr) {
+      return;
+    }
+    ThingEventObject *old = curr->next;
+    curr->next = nullptr;
+    while (old != nullptr) {
+      ThingEventObject *next = old->next;
+      delete old;
+      old = next;
+    }
   }
+#endif
 
   void serializeActionQueue(JsonArray array) {
+    holdActions();
     ThingActionObject *curr = actionQueue;
     while (curr != nullptr) {
-      JsonObject action = array.createNestedObject();
-      curr->serialize(action, id);
+      if (!curr->removeRequested) {
+        JsonObject action = array.createNestedObject();
+        curr->serialize(action, id);
+      }
       curr = curr->next;
     }
+    releaseActions();
   }
 
-  void serializeActionQueue(JsonArray array, String name) {
+  void serializeActionQueue(JsonArray array, const String &name) {
+    holdActions();
     ThingActionObject *curr = actionQueue;
     while (curr != nullptr) {
-      if (curr->name == name) {
+      if (name == curr->name && !curr->removeRequested) {
         JsonObject action = array.createNestedObject();
         curr->serialize(action, id);
       }
       curr = curr->next;
     }
+    releaseActions();
   }
 
   void serializeEventQueue(JsonArray array) {
@@ -819,10 +3248,10 @@ public:
     }
   }
 
-  void serializeEventQueue(JsonArray array, String name) {
+  void serializeEventQueue(JsonArray array, const String &name) {
     ThingEventObject *curr = eventQueue;
     while (curr != nullptr) {
-      if (curr->name == name) {
+      if (name == curr->name) {
         JsonObject event = array.createNestedObject();
         curr->serialize(event);
       }
@@ -830,3 +3259,65 @@ public:
     }
   }
 };
+
+#ifdef WITH_STATIC_ALLOCATION
+/**
+ * Frees the pools for one more action request if they are exhausted, by
+ * deleting the oldest finished action of the first device that has one,
+ * like the event queue drops its oldest events. Called by the adapters
+ * before copying a request.
+ */
+inline void thingMakeRoomForAction(ThingDevice *firstDevice) {
+  if (!thingActionSlab().isFull() && !thingActionPool().isFull()) {
+    return;
+  }
+  ThingDevice *device = firstDevice;
+  while (device != nullptr && !device->removeOldestFinishedAction()) {
+    device = device->next;
+  }
+}
+#endif
+
+/**
+ * Stages the property changes of a device for as long as it is in scope:
+ *
+ *   {
+ *     ThingUpdate update(device);
+ *     temperature.setValue(t);
+ *     humidity.setValue(h);
+ *   } // both values are published here
+ */
+class ThingUpdate {
+public:
+  explicit ThingUpdate(ThingDevice &device_) : device(device_) {
+    device.beginUpdate();
+  }
+
+  ~ThingUpdate() { device.commitUpdate(); }
+
+  ThingUpdate(const ThingUpdate &) = delete;
+  ThingUpdate &operator=(const ThingUpdate &) = delete;
+
+private:
+  ThingDevice &device;
+};
+
+/**
+ * Holds the actions of a device for as long as it is in scope, so that
+ * update() does not delete an action a request handler is using, e.g. one
+ * it just queued and started.
+ */
+class ThingActionHold {
+public:
+  explicit ThingActionHold(ThingDevice &device_) : device(device_) {
+    device.holdActions();
+  }
+
+  ~ThingActionHold() { device.releaseActions(); }
+
+  ThingActionHold(const ThingActionHold &) = delete;
+  ThingActionHold &operator=(const ThingActionHold &) = delete;
+
+private:
+  ThingDevice &device;
+};
@@ -20,8 +20,10 @@
 #include <WiFi101.h>
 #endif
 
+#ifndef WITHOUT_MDNS
 #include <WiFiUdp.h>
 #include <ArduinoMDNS.h>
+#endif
 
 #include <ArduinoJson.h>
 
@@ -58,19 +60,60 @@ enum HTTPMethod {
 enum ReadState {
   STATE_READ_METHOD,
   STATE_READ_URI,
+  STATE_READ_QUERY,
   STATE_DISCARD_HTTP11,
-  STATE_DISCARD_HEADERS_PRE_HOST,
-  STATE_READ_HOST,
-  STATE_DISCARD_HEADERS_POST_HOST,
+  STATE_READ_HEADER_NAME,
+  STATE_READ_HEADER_VALUE,
   STATE_READ_CONTENT
 };
 
+// Property reads waiting for a change (?waitFor=) at the same time
+#ifndef LONG_POLL_MAX_REQUESTS
+#define LONG_POLL_MAX_REQUESTS 1
+#endif
+
+#ifndef LONG_POLL_DEFAULT_TIMEOUT
+#define LONG_POLL_DEFAULT_TIMEOUT 10000
+#endif
+
+#ifndef LONG_POLL_MAX_TIMEOUT
+#define LONG_POLL_MAX_TIMEOUT 30000
+#endif
+
+#ifdef WITH_SSE
+// Event streams kept open at the same time
+#ifndef SSE_MAX_CLIENTS
+#define SSE_MAX_CLIENTS 1
+#endif
+#endif
+
+#ifdef WITH_STATIC_ALLOCATION
+// Buffers reserved in begin() for the request line, headers and body, longer
+// ones fail the request with 414, 431 or 413. REQUEST_URI_SIZE is set in
+// Thing.h, which puts links of that length together.
+#ifndef REQUEST_HEADER_SIZE
+#define REQUEST_HEADER_SIZE 48
+#endif
+#ifndef REQUEST_CONTENT_SIZE
+#define REQUEST_CONTENT_SIZE SMALL_JSON_DOCUMENT_SIZE
+#endif
+#else
+#define REQUEST_URI_SIZE 0
+#define REQUEST_HEADER_SIZE 0
+#define REQUEST_CONTENT_SIZE 0
+#endif
+
 class WebThingAdapter {
 public:
-  WebThingAdapter(String _name, uint32_t _ip, uint16_t _port = 80,
+  WebThingAdapter(const String &_name, uint32_t _ip, uint16_t _port = 80,
                   bool _disableHostValidation = false)
       : name(_name), port(_port), server(_port),
-        disableHostValidation(_disableHostValidation), mdns(udp) {
+        disableHostValidation(_disableHostValidation)
+#ifndef WITHOUT_MDNS
+        ,
+        mdns(udp)
+#endif
+  {
     ip = "";
     for (int i = 0; i < 4; i++) {
       ip += _ip & 0xff;
@@ -84,32 +127,43 @@ public:
   void begin() {
     name.toLowerCase();
 
+#ifndef WITHOUT_MDNS
     String serviceName = name + "._webthing";
     mdns.begin(WiFi.localIP(), name.c_str());
     // \x06 is the length of the record
     mdns.addServiceRecord(serviceName.c_str(), port, MDNSServiceTCP,
                           "\x06path=/");
+#endif
 
     server.begin();
+    reserveBuffers();
   }
 
   void update() {
+#ifndef WITHOUT_MDNS
     mdns.run();
+#endif
 
+    runCallbacks();
+#ifdef WITH_SSE
+    streamMessages();
+#endif
+    answerPendingReads();
+    updateWatchers();
     if (!client) {
       WiFiClient client = server.available();
       if (!client) {
         return;
       }
       if (DEBUG) {
-        Serial.println("New client available");
+        Serial.println(F("New client available"));
       }
       this->client = client;
     }
 
     if (!client.connected()) {
       if (DEBUG) {
-        Serial.println("Client disconnected");
+        Serial.println(F("Client disconnected"));
       }
       resetParser();
       client.stop();
@@ -126,7 +180,7 @@ public:
       retries += 1;
       if (retries > 5000) {
         if (DEBUG) {
-          Serial.println("Giving up on client");
+          Serial.println(F("Giving up on client"));
         }
         resetParser();
         client.stop();
@@ -152,72 +206,85 @@ public:
         }
         state = STATE_READ_URI;
       } else {
-        methodRaw += c;
+        append(methodRaw, c, REQUEST_HEADER_SIZE, 0);
       }
       break;
 
     case STATE_READ_URI:
+      if (c == ' ') {
+        state = STATE_DISCARD_HTTP11;
+      } else if (c == '?') {
+        state = STATE_READ_QUERY;
+      } else {
+        append(uri, c, REQUEST_URI_SIZE, 414);
+      }
+      break;
+
+    case STATE_READ_QUERY:
       if (c == ' ') {
         state = STATE_DISCARD_HTTP11;
       } else {
-        uri += c;
+        append(query, c, REQUEST_URI_SIZE, 414);
       }
       break;
 
     case STATE_DISCARD_HTTP11:
-      if (c == '\r') {
-        state = STATE_DISCARD_HEADERS_PRE_HOST;
+      if (c == '\n') {
+        state = STATE_READ_HEADER_NAME;
       }
       break;
 
-    case STATE_DISCARD_HEADERS_PRE_HOST:
+    case STATE_READ_HEADER_NAME:
       if (c == '\r') {
         break;
       }
       if (c == '\n') {
+        if (headerRaw.length() == 0) {
+          // An empty line ends the headers
+          state = STATE_READ_CONTENT;
+        }
         headerRaw = "";
         break;
       }
       if (c == ':') {
+        header = nullptr;
         if (headerRaw.equalsIgnoreCase("Host")) {
-          state = STATE_READ_HOST;
+          header = &host;
         }
+#ifdef WITH_SSE
+        if (headerRaw.equalsIgnoreCase("Last-Event-ID")) {
+          header = &lastEventId;
+        }
+#endif
+        state = STATE_READ_HEADER_VALUE;
         break;
       }
 
-      headerRaw += c;
+      append(headerRaw, c, REQUEST_HEADER_SIZE, 0);
       break;
 
-    case STATE_READ_HOST:
+    case STATE_READ_HEADER_VALUE:
       if (c == '\r') {
-        returnsAndNewlines = 1;
-        state = STATE_DISCARD_HEADERS_POST_HOST;
         break;
       }
-      if (c == ' ') {
+      if (c == '\n') {
+        headerRaw = "";
+        state = STATE_READ_HEADER_NAME;
         break;
       }
-      host += c;
-      break;
-
-    case STATE_DISCARD_HEADERS_POST_HOST:
-      if (c == '\r' || c == '\n') {
-        returnsAndNewlines += 1;
-      } else {
-        returnsAndNewlines = 0;
-      }
-      if (returnsAndNewlines == 4) {
-        state = STATE_READ_CONTENT;
+      if (c != ' ' && header != nullptr) {
+        append(*header, c, REQUEST_HEADER_SIZE, 431);
       }
       break;
 
     case STATE_READ_CONTENT:
-      content += c;
+      append(content, c, REQUEST_CONTENT_SIZE, 413);
       break;
     }
   }
 
   void addDevice(ThingDevice *device) {
+    device->setAddress(ip, port);
     if (this->lastDevice == nullptr) {
       this->firstDevice = device;
       this->lastDevice = device;
@@ -233,22 +300,105 @@ private:
   bool disableHostValidation;
   WiFiServer server;
   WiFiClient client;
+#ifndef WITHOUT_MDNS
   WiFiUDP udp;
   MDNS mdns;
+#endif
 
   ReadState state = STATE_READ_METHOD;
   String uri = "";
+  String query = "";
   HTTPMethod method = HTTP_ANY;
   String content = "";
   String methodRaw = "";
   String host = "";
   String headerRaw = "";
-  int returnsAndNewlines = 0;
+  String *header = nullptr;
   int retries = 0;
+#ifdef WITH_STATIC_ALLOCATION
+  // Status for a request that did not fit into the buffers, 0 if it did
+  uint16_t tooLongStatus = 0;
+#endif
+#ifdef WITH_SSE
+  String lastEventId = "";
+
+  struct StreamClient {
+    WiFiClient client;
+    ThingDevice *device = nullptr;
+    uint32_t seq = 0;
+  };
+  StreamClient streams[SSE_MAX_CLIENTS];
+#endif
+
+  struct PendingRead {
+    WiFiClient client;
+    ThingDevice *device = nullptr;
+    ThingItem *item = nullptr;
+    uint32_t waitFor = 0;
+    long since = -1;
+    unsigned long deadline = 0;
+  };
+  PendingRead pendingReads[LONG_POLL_MAX_REQUESTS];
 
   ThingDevice *firstDevice = nullptr, *lastDevice = nullptr;
 
+  /**
+   * Allocates what serving requests needs up front, so that with
+   * WITH_STATIC_ALLOCATION nothing is allocated afterwards.
+   */
+  void reserveBuffers() {
+#ifdef WITH_JSON_POOL
+    thingJsonPool();
+#endif
+#ifdef WITH_STATIC_ALLOCATION
+    thingActionPool();
+    methodRaw.reserve(REQUEST_HEADER_SIZE);
+    uri.reserve(REQUEST_URI_SIZE);
+    query.reserve(REQUEST_URI_SIZE);
+    headerRaw.reserve(REQUEST_HEADER_SIZE);
+    host.reserve(REQUEST_HEADER_SIZE);
+#ifdef WITH_SSE
+    lastEventId.reserve(REQUEST_HEADER_SIZE);
+    ThingDevice *device = this->firstDevice;
+    while (device != nullptr) {
+      device->log.reserveBuffers();
+      device = device->next;
+    }
+#endif
+    content.reserve(REQUEST_CONTENT_SIZE);
+#endif
+  }
+
+  /**
+   * Adds c to s. With WITH_STATIC_ALLOCATION, once s is full the request
+   * fails with status, or with status 0 s is cut short, for names that are
+   * only compared against shorter ones.
+   */
+  void append(String &s, char c, unsigned int limit, uint16_t status) {
+#ifdef WITH_STATIC_ALLOCATION
+    if (s.length() >= limit) {
+      if (tooLongStatus == 0) {
+        tooLongStatus = status;
+      }
+      return;
+    }
+#else
+    (void)limit;
+    (void)status;
+#endif
+    s += c;
+  }
+
+  /** Whether the uri is path followed by suffix. */
+  bool uriIs(const String &path, const char *suffix) {
+    return uri.startsWith(path) &&
+           !strcmp(uri.c_str() + path.length(), suffix);
+  }
+
   bool verifyHost() {
+#ifdef WITHOUT_HOST_VALIDATION
+    return true;
+#else
     if (disableHostValidation) {
       return true;
     }
@@ -257,7 +407,10 @@ private:
     if (colonIndex >= 0) {
       host.remove(colonIndex);
     }
-    if (host.equalsIgnoreCase(name + ".local")) {
+    // <name>.local, compared in place
+    if (host.length() == name.length() + 6 &&
+        !strncasecmp(host.c_str(), name.c_str(), name.length()) &&
+        !strcasecmp(host.c_str() + name.length(), ".local")) {
       return true;
     }
     if (host == ip) {
@@ -267,24 +420,32 @@ private:
       return true;
     }
     return false;
+#endif
   }
 
   void handleRequest() {
     if (DEBUG) {
-      Serial.print("handleRequest: ");
-      Serial.print("method: ");
+      Serial.print(F("handleRequest: "));
+      Serial.print(F("method: "));
       Serial.println(method);
-      Serial.print("uri: ");
+      Serial.print(F("uri: "));
       Serial.println(uri);
-      Serial.print("host: ");
+      Serial.print(F("host: "));
       Serial.println(host);
-      Serial.print("content: ");
+      Serial.print(F("content: "));
       Serial.println(content);
     }
 
+#ifdef WITH_STATIC_ALLOCATION
+    if (tooLongStatus != 0) {
+      handleTooLong();
+      return;
+    }
+#endif
+
     if (!verifyHost()) {
-      client.println("HTTP/1.1 403 Forbidden");
-      client.println("Connection: close");
+      client.println(F("HTTP/1.1 403 Forbidden"));
+      client.println(F("Connection: close"));
       client.println();
       delay(1);
       client.stop();
@@ -298,24 +459,26 @@ private:
 
     ThingDevice *device = this->firstDevice;
     while (device != nullptr) {
-      String deviceBase = "/things/" + device->id;
-
-      if (uri.startsWith(deviceBase)) {
-        if (uri == deviceBase) {
+      if (uri.startsWith(device->href)) {
+        if (uri == device->href) {
           if (method == HTTP_GET || method == HTTP_OPTIONS) {
             handleThing(device);
           } else {
             handleError();
           }
           return;
-        } else if (uri == deviceBase + "/properties") {
+        } else if (uriIs(device->href, "/properties")) {
           if (method == HTTP_GET || method == HTTP_OPTIONS) {
-            handleThingPropertiesGet(device->firstProperty);
+            handleThingPropertiesGet(device);
+          } else if (method == HTTP_PUT) {
+            handleThingPropertiesPut(device);
           } else {
             handleError();
           }
           return;
-        } else if (uri == deviceBase + "/actions") {
+#ifndef WITHOUT_ACTIONS
+        } else if (device->firstAction != nullptr &&
+                   uriIs(device->href, "/actions")) {
           if (method == HTTP_GET || method == HTTP_OPTIONS) {
             handleThingActionsGet(device);
           } else if (method == HTTP_POST) {
@@ -324,20 +487,32 @@ private:
             handleError();
           }
           return;
-        } else if (uri == deviceBase + "/events") {
+#endif
+#ifdef WITH_SSE
+        } else if (uriIs(device->href, "/stream")) {
+          if (method == HTTP_GET) {
+            handleThingStream(device);
+          } else {
+            handleError();
+          }
+          return;
+#endif
+#ifndef WITHOUT_EVENTS
+        } else if (device->firstEvent != nullptr &&
+                   uriIs(device->href, "/events")) {
           if (method == HTTP_GET || method == HTTP_OPTIONS) {
             handleThingEventsGet(device);
           } else {
             handleError();
           }
           return;
+#endif
         } else {
           ThingProperty *property = device->firstProperty;
           while (property != nullptr) {
-            String propertyBase = deviceBase + "/properties/" + property->id;
-            if (uri == propertyBase) {
+            if (uri == property->href) {
               if (method == HTTP_GET || method == HTTP_OPTIONS) {
-                handleThingPropertyGet(property);
+                handleThingPropertyGet(device, property);
               } else if (method == HTTP_PUT) {
                 handleThingPropertyPut(device, property);
               } else {
@@ -348,10 +523,10 @@ private:
             property = (ThingProperty *)property->next;
           }
 
+#ifndef WITHOUT_ACTIONS
           ThingAction *action = device->firstAction;
           while (action != nullptr) {
-            String actionBase = deviceBase + "/actions/" + action->id;
-            if (uri == actionBase) {
+            if (uri == action->href) {
               if (method == HTTP_GET || method == HTTP_OPTIONS) {
                 handleThingActionGet(device, action);
               } else if (method == HTTP_POST) {
@@ -360,8 +535,9 @@ private:
                 handleError();
               }
               return;
-            } else if (uri.startsWith(actionBase + "/") &&
-                       uri.length() > (actionBase.length() + 1)) {
+            } else if (uri.startsWith(action->href) &&
+                       uri[action->href.length()] == '/' &&
+                       uri.length() > action->href.length() + 1) {
               if (method == HTTP_GET || method == HTTP_OPTIONS) {
                 handleThingActionIdGet(device, action);
               } else if (method == HTTP_DELETE) {
@@ -373,11 +549,12 @@ private:
             }
             action = action->next;
           }
+#endif
 
+#ifndef WITHOUT_EVENTS
           ThingEvent *event = device->firstEvent;
           while (event != nullptr) {
-            String eventBase = deviceBase + "/events/" + event->id;
-            if (uri == eventBase) {
+            if (uri == event->href) {
               if (method == HTTP_GET || method == HTTP_OPTIONS) {
                 handleThingEventGet(device, event);
               } else {
@@ -387,6 +564,7 @@ private:
             }
             event = (ThingEvent *)event->next;
           }
+#endif
         }
       }
       device = device->next;
@@ -394,34 +572,61 @@ private:
     handleError();
   }
 
-  void sendOk() { client.println("HTTP/1.1 200 OK"); }
+  void sendOk() { client.println(F("HTTP/1.1 200 OK")); }
 
-  void sendCreated() { client.println("HTTP/1.1 201 Created"); }
+  void sendCreated() { client.println(F("HTTP/1.1 201 Created")); }
 
-  void sendNoContent() { client.println("HTTP/1.1 204 No Content"); }
+  void sendNoContent() { client.println(F("HTTP/1.1 204 No Content")); }
 
-  void sendHeaders() {
-    client.println("Access-Control-Allow-Origin: *");
-    client.println(
-        "Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS");
-    client.println("Access-Control-Allow-Headers: "
-                   "Origin, X-Requested-With, Content-Type, Accept");
-    client.println("Content-Type: application/json");
-    client.println("Connection: close");
-    client.println();
+  void sendHeaders() { sendHeaders(client); }
+
+  void sendHeaders(WiFiClient &out) {
+#ifndef WITHOUT_CORS
+    out.println(F("Access-Control-Allow-Origin: *"));
+    out.println(
+        F("Access-Control-Allow-Methods: GET, POST, PUT, DELETE, OPTIONS"));
+    out.println(F("Access-Control-Allow-Headers: "
+                  "Origin, X-Requested-With, Content-Type, Accept"));
+    out.println(F("Access-Control-Expose-Headers: X-Thing-Version"));
+#endif
+    out.println(F("Content-Type: application/json"));
+    out.println(F("Connection: close"));
+    out.println();
+  }
+
+  /**
+   * Returns the value of a query parameter as a number, or fallback if the
+   * request has no such parameter.
+   */
+  long queryParam(const char *name, long fallback) {
+    size_t nameLength = strlen(name);
+    const char *param = query.c_str();
+    while (*param != '\0') {
+      if (!strncmp(param, name, nameLength) && param[nameLength] == '=') {
+        // Stops at the '&' of the next parameter
+        return atol(param + nameLength + 1);
+      }
+      param = strchr(param, '&');
+      if (param == nullptr) {
+        break;
+      }
+      param++;
+    }
+    return fallback;
   }
 
   void handleThings() {
     sendOk();
     sendHeaders();
 
-    DynamicJsonDocument buf(LARGE_JSON_DOCUMENT_SIZE);
+    ThingJsonLease bufLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &buf = *bufLease;
     JsonArray things = buf.to<JsonArray>();
     ThingDevice *device = this->firstDevice;
     while (device != nullptr) {
       JsonObject descr = things.createNestedObject();
       device->serialize(descr, ip, port);
-      descr["href"] = "/things/" + device->id;
+      descr["href"] = device->href.c_str();
       device = device->next;
     }
 
@@ -434,7 +639,8 @@ private:
     sendOk();
     sendHeaders();
 
-    DynamicJsonDocument buf(LARGE_JSON_DOCUMENT_SIZE);
+    ThingJsonLease bufLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &buf = *bufLease;
     JsonObject descr = buf.to<JsonObject>();
     device->serialize(descr, ip, port);
 
@@ -443,23 +649,248 @@ private:
     client.stop();
   }
 
-  void handleThingPropertyGet(ThingItem *item) {
+#ifdef WITH_SSE
+  /**
+   * Answers with an event stream and keeps the connection open in a stream
+   * slot, so that the adapter can accept other requests meanwhile.
+   */
+  void handleThingStream(ThingDevice *device) {
+    StreamClient *stream = nullptr;
+    for (int i = 0; i < SSE_MAX_CLIENTS; i++) {
+      if (streams[i].device == nullptr) {
+        stream = &streams[i];
+        break;
+      }
+    }
+
+    if (stream == nullptr) {
+      handleUnavailable();
+      return;
+    }
+
     sendOk();
-    sendHeaders();
+#ifndef WITHOUT_CORS
+    client.println(F("Access-Control-Allow-Origin: *"));
+#endif
+    client.println(F("Content-Type: text/event-stream"));
+    client.println(F("Cache-Control: no-cache"));
+    client.println();
+
+    stream->client = client;
+    stream->device = device;
+    // Without Last-Event-ID, only messages from now on are sent
+    stream->seq = lastEventId.length() > 0 ? lastEventId.toInt()
+                                            : device->log.lastSeq;
+    client = WiFiClient();
+  }
 
-    DynamicJsonDocument doc(SMALL_JSON_DOCUMENT_SIZE);
+  void streamMessages() {
+    ThingDevice *device = this->firstDevice;
+    while (device != nullptr) {
+      device->publishChangedProperties();
+      device = device->next;
+    }
+
+    for (int i = 0; i < SSE_MAX_CLIENTS; i++) {
+      StreamClient &stream = streams[i];
+      if (stream.device == nullptr) {
+        continue;
+      }
+
+      if (!stream.client.connected()) {
+        stream.client.stop();
+        stream.device = nullptr;
+        continue;
+      }
+
+      ThingMessageLog &log = stream.device->log;
+      if (!log.canResumeFrom(stream.seq)) {
+        sendStreamSnapshot(stream);
+        continue;
+      }
+
+      while (stream.seq < log.lastSeq) {
+        ThingMessageLog::Entry *entry = log.find(stream.seq + 1);
+        if (entry == nullptr) {
+          // Left out of the log for its length
+          sendStreamSnapshot(stream);
+          break;
+        }
+        stream.seq++;
+        beginStreamMessage(stream.client, entry->seq, entry->type);
+        stream.client.println(entry->data);
+        stream.client.println();
+      }
+    }
+  }
+
+  /**
+   * Sends the value of every property to a stream that missed messages,
+   * serialized straight to the client.
+   */
+  void sendStreamSnapshot(StreamClient &stream) {
+    ThingMessageLog &log = stream.device->log;
+    beginStreamMessage(stream.client, log.lastSeq, "propertyStatus");
+    stream.device->serializePropertySnapshot(stream.client);
+    stream.client.println();
+    stream.client.println();
+    stream.seq = log.lastSeq;
+  }
+
+  void beginStreamMessage(WiFiClient &streamClient, uint32_t seq,
+                          const char *type) {
+    streamClient.print(F("id: "));
+    streamClient.println(seq);
+    streamClient.print(F("event: "));
+    streamClient.println(type);
+    streamClient.print(F("data: "));
+  }
+#endif
+
+  void handleThingPropertyGet(ThingDevice *device, ThingItem *item) {
+    handlePropertyRead(device, item);
+  }
+
+  /**
+   * Answers a read of one property, or of all properties if item is null.
+   * With ?waitFor=<version> the connection is parked until a value changes
+   * after that version or ?timeout=<ms> passes. With ?since=<version> only
+   * the properties changed after that version are included.
+   */
+  void handlePropertyRead(ThingDevice *device, ThingItem *item) {
+    long since = item == nullptr ? queryParam("since", -1) : -1;
+    long waitFor = queryParam("waitFor", -1);
+    if (waitFor >= 0 && !device->hasChangedSince(item, waitFor)) {
+      unsigned long timeout = queryParam("timeout", LONG_POLL_DEFAULT_TIMEOUT);
+      if (timeout > LONG_POLL_MAX_TIMEOUT) {
+        timeout = LONG_POLL_MAX_TIMEOUT;
+      }
+      if (parkRead(device, item, waitFor, since, timeout)) {
+        return;
+      }
+    }
+
+    // Handlers run within update(), so the sampler can be called right away
+    device->sampleForRead(item);
+    sendPropertyValues(client, device, item, since);
+  }
+
+  bool parkRead(ThingDevice *device, ThingItem *item, uint32_t waitFor,
+                long since, unsigned long timeout) {
+    for (int i = 0; i < LONG_POLL_MAX_REQUESTS; i++) {
+      PendingRead &pending = pendingReads[i];
+      if (pending.device != nullptr) {
+        continue;
+      }
+
+      pending.client = client;
+      pending.device = device;
+      pending.item = item;
+      pending.waitFor = waitFor;
+      pending.since = since;
+      pending.deadline = millis() + timeout;
+      device->markPropertiesRead(item);
+      client = WiFiClient();
+      return true;
+    }
+
+    // All slots are taken, answer right away
+    return false;
+  }
+
+  /**
+   * Applies values set from interrupt handlers, ticks running actions and
+   * calls the samplers of watched properties.
+   */
+  void runCallbacks() {
+    ThingDevice *device = this->firstDevice;
+    while (device != nullptr) {
+#ifdef WITH_ISR_VALUES
+      device->applyISRValues();
+#endif
+      device->tickActions();
+      device->sampleProperties();
+      device = device->next;
+    }
+  }
+
+  void updateWatchers() {
+    ThingDevice *device = this->firstDevice;
+    while (device != nullptr) {
+      uint16_t streamCount = 0;
+#ifdef WITH_SSE
+      for (int i = 0; i < SSE_MAX_CLIENTS; i++) {
+        if (streams[i].device == device) {
+          streamCount++;
+        }
+      }
+#endif
+      device->updateWatchers(streamCount);
+      device = device->next;
+    }
+  }
+
+  void answerPendingReads() {
+    unsigned long now = millis();
+    for (int i = 0; i < LONG_POLL_MAX_REQUESTS; i++) {
+      PendingRead &pending = pendingReads[i];
+      if (pending.device == nullptr) {
+        continue;
+      }
+
+      if (!pending.client.connected()) {
+        pending.client.stop();
+        pending.device = nullptr;
+        continue;
+      }
+
+      if (pending.device->hasChangedSince(pending.item, pending.waitFor) ||
+          (long)(now - pending.deadline) >= 0) {
+        sendPropertyValues(pending.client, pending.device, pending.item,
+                           pending.since);
+        pending.device = nullptr;
+      }
+    }
+  }
+
+  /**
+   * Sends one property, or all properties if item is null. A since other
+   * than -1 limits the properties to those changed after that version.
+   */
+  void sendPropertyValues(WiFiClient &out, ThingDevice *device,
+                          ThingItem *item, long since) {
+    out.println(F("HTTP/1.1 200 OK"));
+    out.print(F("X-Thing-Version: "));
+    out.println(device->version.current);
+    sendHeaders(out);
+    device->markPropertiesRead(item);
+
+    ThingJsonLease docLease(item != nullptr ? SMALL_JSON_DOCUMENT_SIZE
+                                            : LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &doc = *docLease;
     JsonObject prop = doc.to<JsonObject>();
-    item->serializeValue(prop);
-    serializeJson(prop, client);
+    if (item != nullptr) {
+      item->serializeValue(prop);
+    } else if (since >= 0) {
+      device->serializeChangedValues(prop, since);
+    } else {
+      ThingItem *property = device->firstProperty;
+      while (property != nullptr) {
+        property->serializeValue(prop);
+        property = property->next;
+      }
+    }
+    serializeJson(prop, out);
     delay(1);
-    client.stop();
+    out.stop();
   }
 
   void handleThingActionGet(ThingDevice *device, ThingAction *action) {
     sendOk();
     sendHeaders();
 
-    DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+    ThingJsonLease docLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &doc = *docLease;
     JsonArray queue = doc.to<JsonArray>();
     device->serializeActionQueue(queue, action->id);
     serializeJson(queue, client);
@@ -468,16 +899,10 @@ private:
   }
 
   void handleThingActionIdGet(ThingDevice *device, ThingAction *action) {
-    String base = "/things/" + device->id + "/actions/" + action->id;
-    String actionId = uri.substring(base.length() + 1);
-    const char *actionIdC = actionId.c_str();
-    const char *slash = strchr(actionIdC, '/');
+    char actionId[THING_ACTION_ID_LENGTH + 2];
+    thingActionIdOf(uri.c_str() + action->href.length() + 1, actionId);
 
-    if (slash) {
-      actionId = actionId.substring(0, slash - actionIdC);
-    }
-
-    ThingActionObject *obj = device->findActionObject(actionId.c_str());
+    ThingActionObject *obj = device->findActionObject(actionId);
     if (obj == nullptr) {
       handleError();
       return;
@@ -486,7 +911,8 @@ private:
     sendOk();
     sendHeaders();
 
-    DynamicJsonDocument doc(SMALL_JSON_DOCUMENT_SIZE);
+    ThingJsonLease docLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &doc = *docLease;
     JsonObject o = doc.to<JsonObject>();
     obj->serialize(o, device->id);
     serializeJson(o, client);
@@ -495,14 +921,8 @@ private:
   }
 
   void handleThingActionIdDelete(ThingDevice *device, ThingAction *action) {
-    String base = "/things/" + device->id + "/actions/" + action->id;
-    String actionId = uri.substring(base.length() + 1);
-    const char *actionIdC = actionId.c_str();
-    const char *slash = strchr(actionIdC, '/');
-
-    if (slash) {
-      actionId = actionId.substring(0, slash - actionIdC);
-    }
+    char actionId[THING_ACTION_ID_LENGTH + 2];
+    thingActionIdOf(uri.c_str() + action->href.length() + 1, actionId);
 
     device->removeAction(actionId);
     sendNoContent();
@@ -510,35 +930,43 @@ private:
   }
 
   void handleThingActionPost(ThingDevice *device, ThingAction *action) {
-    DynamicJsonDocument *newBuffer =
-        new DynamicJsonDocument(SMALL_JSON_DOCUMENT_SIZE);
-    auto error = deserializeJson(*newBuffer, content);
+    StaticJsonDocument<JSON_OBJECT_SIZE(1)> filter;
+    filter[action->id.c_str()] = true;
+
+    ThingJsonLease newBufferLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &newBuffer = *newBufferLease;
+    auto error = deserializeJson(newBuffer, content,
+                                 DeserializationOption::Filter(filter));
     if (error) { // unable to parse json
       handleError();
-      delete newBuffer;
       return;
     }
 
-    JsonObject newAction = newBuffer->as<JsonObject>();
+    JsonObject newAction = newBuffer.as<JsonObject>();
 
     if (!newAction.containsKey(action->id)) {
       handleError();
-      delete newBuffer;
       return;
     }
 
-    ThingActionObject *obj = device->requestAction(newBuffer);
+#ifdef WITH_STATIC_ALLOCATION
+    thingMakeRoomForAction(firstDevice);
+#endif
+    DynamicJsonDocument *actionRequest = thingJsonCopy(newBuffer);
+    ThingActionObject *obj = device->requestAction(actionRequest);
 
     if (obj == nullptr) {
-      handleError();
-      delete newBuffer;
+      // The action exists, so memory for it has run out
+      handleUnavailable();
+      thingJsonFree(actionRequest);
       return;
     }
 
     sendCreated();
     sendHeaders();
 
-    DynamicJsonDocument respBuffer(SMALL_JSON_DOCUMENT_SIZE);
+    ThingJsonLease respBufferLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &respBuffer = *respBufferLease;
     JsonObject item = respBuffer.to<JsonObject>();
     obj->serialize(item, device->id);
     serializeJson(item, client);
@@ -552,7 +980,9 @@ private:
     sendOk();
     sendHeaders();
 
-    DynamicJsonDocument doc(SMALL_JSON_DOCUMENT_SIZE);
+    item->markRead();
+    ThingJsonLease docLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &doc = *docLease;
     JsonArray queue = doc.to<JsonArray>();
     device->serializeEventQueue(queue, item->id);
     serializeJson(queue, client);
@@ -560,27 +990,16 @@ private:
     client.stop();
   }
 
-  void handleThingPropertiesGet(ThingItem *rootItem) {
-    sendOk();
-    sendHeaders();
-
-    DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
-    JsonObject prop = doc.to<JsonObject>();
-    ThingItem *item = rootItem;
-    while (item != nullptr) {
-      item->serializeValue(prop);
-      item = item->next;
-    }
-    serializeJson(prop, client);
-    delay(1);
-    client.stop();
+  void handleThingPropertiesGet(ThingDevice *device) {
+    handlePropertyRead(device, nullptr);
   }
 
   void handleThingActionsGet(ThingDevice *device) {
     sendOk();
     sendHeaders();
 
-    DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+    ThingJsonLease docLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &doc = *docLease;
     JsonArray queue = doc.to<JsonArray>();
     device->serializeActionQueue(queue);
     serializeJson(queue, client);
@@ -589,35 +1008,40 @@ private:
   }
 
   void handleThingActionsPost(ThingDevice *device) {
-    DynamicJsonDocument *newBuffer =
-        new DynamicJsonDocument(SMALL_JSON_DOCUMENT_SIZE);
-    auto error = deserializeJson(*newBuffer, content);
+    ThingJsonLease newBufferLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &newBuffer = *newBufferLease;
+    auto error = deserializeJson(newBuffer, content);
     if (error) { // unable to parse json
       handleError();
-      delete newBuffer;
       return;
     }
 
-    JsonObject newAction = newBuffer->as<JsonObject>();
+    JsonObject newAction = newBuffer.as<JsonObject>();
 
-    if (newAction.size() != 1) {
+    if (newAction.size() != 1 ||
+        device->findAction(newAction.begin()->key().c_str()) == nullptr) {
       handleError();
-      delete newBuffer;
       return;
     }
 
-    ThingActionObject *obj = device->requestAction(newBuffer);
+#ifdef WITH_STATIC_ALLOCATION
+    thingMakeRoomForAction(firstDevice);
+#endif
+    DynamicJsonDocument *actionRequest = thingJsonCopy(newBuffer);
+    ThingActionObject *obj = device->requestAction(actionRequest);
 
     if (obj == nullptr) {
-      handleError();
-      delete newBuffer;
+      // The action exists, so memory for it has run out
+      handleUnavailable();
+      thingJsonFree(actionRequest);
       return;
     }
 
     sendCreated();
     sendHeaders();
 
-    DynamicJsonDocument respBuffer(SMALL_JSON_DOCUMENT_SIZE);
+    ThingJsonLease respBufferLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &respBuffer = *respBufferLease;
     JsonObject item = respBuffer.to<JsonObject>();
     obj->serialize(item, device->id);
     serializeJson(item, client);
@@ -631,7 +1055,14 @@ private:
     sendOk();
     sendHeaders();
 
-    DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+    ThingItem *event = device->firstEvent;
+    while (event != nullptr) {
+      event->markRead();
+      event = event->next;
+    }
+
+    ThingJsonLease docLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &doc = *docLease;
     JsonArray queue = doc.to<JsonArray>();
     device->serializeEventQueue(queue);
     serializeJson(queue, client);
@@ -640,8 +1071,13 @@ private:
   }
 
   void handleThingPropertyPut(ThingDevice *device, ThingProperty *property) {
-    DynamicJsonDocument newBuffer(SMALL_JSON_DOCUMENT_SIZE);
-    auto error = deserializeJson(newBuffer, content);
+    StaticJsonDocument<JSON_OBJECT_SIZE(1)> filter;
+    filter[property->id.c_str()] = true;
+
+    ThingJsonLease newBufferLease(SMALL_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &newBuffer = *newBufferLease;
+    auto error = deserializeJson(newBuffer, content,
+                                 DeserializationOption::Filter(filter));
     if (error) { // unable to parse json
       handleError();
       return;
@@ -663,22 +1099,79 @@ private:
     client.stop();
   }
 
+  /**
+   * Applies several properties from one JSON object, e.g.
+   * {"on": true, "level": 40}, and echoes it back.
+   */
+  void handleThingPropertiesPut(ThingDevice *device) {
+    ThingJsonLease newBufferLease(LARGE_JSON_DOCUMENT_SIZE);
+    DynamicJsonDocument &newBuffer = *newBufferLease;
+    auto error = deserializeJson(newBuffer, content);
+    if (error) { // unable to parse json
+      handleError();
+      return;
+    }
+    JsonObject newProps = newBuffer.as<JsonObject>();
+
+    if (newProps.isNull() || !device->setProperties(newProps)) {
+      handleError();
+      return;
+    }
+
+    sendOk();
+    sendHeaders();
+
+    serializeJson(newProps, client);
+    delay(1);
+    client.stop();
+  }
+
   void handleError() {
-    client.println("HTTP/1.1 400 Bad Request");
+    client.println(F("HTTP/1.1 400 Bad Request"));
     sendHeaders();
     delay(1);
     client.stop();
   }
 
+  void handleUnavailable() {
+    client.println(F("HTTP/1.1 503 Service Unavailable"));
+    sendHeaders();
+    delay(1);
+    client.stop();
+  }
+
+#ifdef WITH_STATIC_ALLOCATION
+  void handleTooLong() {
+    if (tooLongStatus == 414) {
+      client.println(F("HTTP/1.1 414 URI Too Long"));
+    } else if (tooLongStatus == 431) {
+      client.println(F("HTTP/1.1 431 Request Header Fields Too Large"));
+    } else {
+      client.println(F("HTTP/1.1 413 Payload Too Large"));
+    }
+    sendHeaders();
+    delay(1);
+    client.stop();
+  }
+#endif
+
   void resetParser() {
     state = STATE_READ_METHOD;
     method = HTTP_ANY;
     methodRaw = "";
     headerRaw = "";
     host = "";
+    header = nullptr;
+#ifdef WITH_SSE
+    lastEventId = "";
+#endif
     uri = "";
+    query = "";
     content = "";
     retries = 0;
+#ifdef WITH_STATIC_ALLOCATION
+    tooLongStatus = 0;
+#endif
   }
 };
 
@@ -69,6 +69,8 @@ void readBME280Data() {
   BME280::PresUnit presUnit(BME280::PresUnit_Pa);
   bme.read(pres, temp, hum, tempUnit, presUnit);
 
+  // Publish the three readings together
+  ThingUpdate update(weather);
   ThingPropertyValue value;
   value.number = pres;
   weatherPres.setValue(value);
@@ -144,6 +146,11 @@ void setup() {
   weatherHum.minimum = 0;
   weatherHum.maximum = 100;
 
+  // update() reads the sensor once a second while anybody watches it
+  weatherTemp.setSampler(readBME280Data, 1000);
+  weatherPres.setSampler(readBME280Data, 1000);
+  weatherHum.setSampler(readBME280Data, 1000);
+
   weather.addProperty(&weatherTemp);
   weather.addProperty(&weatherPres);
   weather.addProperty(&weatherHum);
@@ -151,7 +158,4 @@ void setup() {
   adapter->begin();
 }
 
-void loop() {
-  readBME280Data();
-  adapter->update();
-}
+void loop() { adapter->update(); }
@@ -68,6 +68,8 @@ void readBME280Data() {
   BME280::PresUnit presUnit(BME280::PresUnit_Pa);
   bme.read(pres, temp, hum, tempUnit, presUnit);
 
+  // Publish the three readings together
+  ThingUpdate update(weather);
   ThingPropertyValue value;
   value.number = pres;
   weatherPres.setValue(value);
@@ -124,6 +126,11 @@ void setup() {
   adapter = new WebThingAdapter("weathersensor", WiFi.localIP());
 
   weatherTemp.unit = "celsius";
+  // update() reads the sensor once a second while anybody watches it
+  weatherTemp.setSampler(readBME280Data, 1000);
+  weatherPres.setSampler(readBME280Data, 1000);
+  weatherHum.setSampler(readBME280Data, 1000);
+
   weather.addProperty(&weatherTemp);
   weather.addProperty(&weatherPres);
   weather.addProperty(&weatherHum);
@@ -131,7 +138,4 @@ void setup() {
   adapter->begin();
 }
 
-void loop() {
-  readBME280Data();
-  adapter->update();
-}
+void loop() { adapter->update(); }
@@ -149,12 +149,21 @@ void loop(void) {
   }
 }
 
-void do_fade(const JsonVariant &input) {
-  JsonObject inputObj = input.as<JsonObject>();
+// Called from adapter->update() until the fade is complete, so that the
+// adapter keeps serving requests meanwhile
+void tick_fade(ThingActionObject *action) {
+  JsonObject inputObj = action->getInput().as<JsonObject>();
   long long int duration = inputObj["duration"];
   long long int brightness = inputObj["brightness"];
 
-  delay(duration);
+  unsigned long elapsed = millis() - action->startedAt;
+  if (elapsed < duration) {
+    int progress = elapsed * 10 / duration * 10;
+    if (progress != action->progress) {
+      action->setProgress(progress);
+    }
+    return;
+  }
 
   ThingDataValue value = {.integer = brightness};
   lampLevel.setValue(value);
@@ -165,8 +174,10 @@ void do_fade(const JsonVariant &input) {
   val.number = 102;
   ThingEventObject *ev = new ThingEventObject("overheated", NUMBER, val);
   lamp.queueEventObject(ev);
+
+  action->complete();
 }
 
 ThingActionObject *action_generator(DynamicJsonDocument *input) {
-  return new ThingActionObject("fade", input, do_fade, nullptr);
+  return new ThingActionObject("fade", input, nullptr, nullptr, tick_fade);
 }
@@ -0,0 +1,187 @@
+/**
+ * Arduino.h
+ *
+ * Just enough of the Arduino core to build Thing.h on the host, where the
+ * tests run. portMUX is a spinlock, so that two std::threads stand in for
+ * loop() and the AsyncTCP task of an ESP32.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#define ARDUINOJSON_ENABLE_ARDUINO_STRING 1
+#define ARDUINOJSON_ENABLE_PROGMEM 1
+
+class __FlashStringHelper;
+#define F(s) (reinterpret_cast<const __FlashStringHelper *>(s))
+#define PROGMEM
+#define PGM_P const char *
+#define strlen_P strlen
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define memcpy_P memcpy
+#define pgm_read_byte(p) (*reinterpret_cast<const uint8_t *>(p))
+#define pgm_read_dword(p) (*reinterpret_cast<const uint32_t *>(p))
+#define pgm_read_float(p) (*reinterpret_cast<const float *>(p))
+#define pgm_read_ptr(p) (*reinterpret_cast<void *const *>(p))
+#define IRAM_ATTR
+
+/** Critical sections the calling thread is in, see portENTER_CRITICAL. */
+inline int &thingTestLockDepth() {
+  static thread_local int depth = 0;
+  return depth;
+}
+
+typedef struct {
+  int locked;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED                                          \
+  { 0 }
+#define portENTER_CRITICAL(mux)                                               \
+  do {                                                                        \
+    while (__atomic_exchange_n(&(mux)->locked, 1, __ATOMIC_ACQUIRE)) {        \
+    }                                                                         \
+    thingTestLockDepth()++;                                                   \
+  } while (0)
+#define portEXIT_CRITICAL(mux)                                                \
+  do {                                                                        \
+    thingTestLockDepth()--;                                                   \
+    __atomic_store_n(&(mux)->locked, 0, __ATOMIC_RELEASE);                    \
+  } while (0)
+#define portENTER_CRITICAL_ISR(mux) portENTER_CRITICAL(mux)
+#define portEXIT_CRITICAL_ISR(mux) portEXIT_CRITICAL(mux)
+
+inline unsigned long millis() {
+  using namespace std::chrono;
+  static const steady_clock::time_point start = steady_clock::now();
+  return duration_cast<milliseconds>(steady_clock::now() - start).count();
+}
+
+inline void delay(unsigned long ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+inline long random(long low, long high) { return low + rand() % (high - low); }
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+/**
+ * Arduino's String, which like the real one only grows on demand and keeps
+ * even short strings on the heap, so that tests see every copy.
+ */
+class String {
+public:
+  String() {}
+  String(const char *s) : buffer(s ? s : "") { own(); }
+  String(const __FlashStringHelper *s)
+      : buffer(reinterpret_cast<const char *>(s)) {
+    own();
+  }
+  String(const String &other) : buffer(other.buffer) { own(other); }
+  String(String &&other) = default;
+  explicit String(int n) : buffer(std::to_string(n)) { own(); }
+  explicit String(unsigned int n) : buffer(std::to_string(n)) { own(); }
+  explicit String(long n) : buffer(std::to_string(n)) { own(); }
+  explicit String(unsigned long n) : buffer(std::to_string(n)) { own(); }
+
+  String &operator=(const String &other) {
+    buffer = other.buffer;
+    own(other);
+    return *this;
+  }
+  String &operator=(String &&other) = default;
+  String &operator=(const char *s) {
+    buffer.assign(s ? s : "");
+    own();
+    return *this;
+  }
+
+  const char *c_str() const { return buffer.c_str(); }
+  unsigned int length() const { return buffer.size(); }
+  bool reserve(unsigned int size) {
+    // In one go, as the real one allocates once
+    buffer.reserve(size > sizeof(std::string) ? size : sizeof(std::string));
+    return true;
+  }
+
+  bool concat(const char *s) {
+    buffer.append(s);
+    own();
+    return true;
+  }
+  bool concat(const String &s) {
+    buffer.append(s.buffer);
+    own();
+    return true;
+  }
+  bool concat(char c) {
+    buffer.push_back(c);
+    own();
+    return true;
+  }
+  String &operator+=(const char *s) {
+    concat(s);
+    return *this;
+  }
+  String &operator+=(const String &s) {
+    concat(s);
+    return *this;
+  }
+  String &operator+=(char c) {
+    concat(c);
+    return *this;
+  }
+
+  // A nullptr equals the empty string, as with Arduino's String
+  bool equals(const char *s) const { return buffer == (s ? s : ""); }
+  bool operator==(const char *s) const { return equals(s); }
+  bool operator==(const String &s) const { return buffer == s.buffer; }
+  bool operator!=(const char *s) const { return !equals(s); }
+  char operator[](unsigned int i) const { return buffer[i]; }
+
+private:
+  std::string buffer;
+
+  /** Moves the characters out of the small buffer of std::string. */
+  void own() {
+    if (buffer.capacity() < sizeof(std::string)) {
+      buffer.reserve(sizeof(std::string));
+    }
+  }
+
+  /** Like own(), for a copy of other, which only has a buffer if set. */
+  void own(const String &other) {
+    if (other.buffer.capacity() >= sizeof(std::string)) {
+      own();
+    }
+  }
+};
+
+class StringSumHelper : public String {
+public:
+  StringSumHelper(const String &s) : String(s) {}
+};
+
+inline StringSumHelper operator+(const String &a, const String &b) {
+  StringSumHelper sum(a);
+  sum += b;
+  return sum;
+}
+
+inline StringSumHelper operator+(const String &a, const char *b) {
+  StringSumHelper sum(a);
+  sum += b;
+  return sum;
+}
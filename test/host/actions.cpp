@@ -0,0 +1,151 @@
+/**
+ * actions.cpp
+ *
+ * Requests actions and queues events with WITH_STATIC_ALLOCATION, as the
+ * Ethernet and WiFi101 adapters do, and WITHOUT_ACTION_HISTORY. Fails if
+ * requests beyond the pools do not fail, if finished actions are not
+ * deleted to make room or by update(), or if anything is allocated or
+ * callbacks are called on the way. Also fails if update() deletes an action
+ * while a request handler holds it.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <Arduino.h>
+#include "Thing.h"
+
+static long allocations = 0;
+
+// Every allocation, of operator new, String and ArduinoJson alike, ends up
+// in one of these. glibc has them forward to its own.
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) noexcept {
+  allocations++;
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) noexcept {
+  allocations++;
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *p, size_t size) noexcept {
+  allocations++;
+  return __libc_realloc(p, size);
+}
+}
+
+static int cancels = 0;
+
+static void start(const JsonVariant &) {}
+static void cancel() { cancels++; }
+static void tick(ThingActionObject *) {}
+
+static ThingActionObject *run(DynamicJsonDocument *request) {
+  return new ThingActionObject("run", request, start, cancel);
+}
+
+static ThingActionObject *wait(DynamicJsonDocument *request) {
+  return new ThingActionObject("wait", request, start, cancel, tick);
+}
+
+static int failures = 0;
+
+static void expect(bool ok, const char *what) {
+  if (!ok) {
+    printf("actions: %s\n", what);
+    failures++;
+  }
+}
+
+/** Queues and starts an action the way requestAction() and the adapters do. */
+static ThingActionObject *request(ThingDevice &device, ThingAction &action) {
+  StaticJsonDocument<64> doc;
+  doc.createNestedObject(action.id.c_str());
+  thingMakeRoomForAction(&device);
+  DynamicJsonDocument *copy = thingJsonCopy(doc);
+  ThingActionObject *obj = copy != nullptr ? action.create(copy) : nullptr;
+  if (obj == nullptr) {
+    thingJsonFree(copy);
+    return nullptr;
+  }
+  device.queueActionObject(obj);
+  obj->start();
+  return obj;
+}
+
+static int count(ThingDevice &device) {
+  int queued = 0;
+  for (ThingActionObject *obj = device.actionQueue; obj != nullptr;
+       obj = obj->next) {
+    queued++;
+  }
+  return queued;
+}
+
+/** Serializes the queues, as a request for them does. */
+static void serializeQueues(ThingDevice &device) {
+  ThingJsonLease docLease(LARGE_JSON_DOCUMENT_SIZE);
+  JsonArray queue = docLease->to<JsonArray>();
+  device.serializeActionQueue(queue);
+  device.serializeEventQueue(queue);
+}
+
+int main() {
+  const char *types[] = {nullptr};
+  ThingDevice device("test", "Test", types);
+  ThingAction runAction("run", run);
+  ThingAction waitAction("wait", wait);
+  ThingEvent alarm("alarm", "", BOOLEAN, "AlarmEvent");
+  device.addAction(&runAction);
+  device.addAction(&waitAction);
+  device.addEvent(&alarm);
+
+  // As begin() does
+  thingJsonPool();
+  thingActionPool();
+  device.log.reserveBuffers();
+  long before = allocations;
+
+  ThingActionObject *waiting[ACTION_POOL_SIZE];
+  for (int i = 0; i < ACTION_POOL_SIZE; i++) {
+    waiting[i] = request(device, waitAction);
+    expect(waiting[i] != nullptr, "running actions do not fit the pools");
+  }
+  expect(request(device, runAction) == nullptr,
+         "an action beyond the pools did not fail");
+
+  waiting[0]->complete();
+  expect(request(device, runAction) != nullptr,
+         "a finished action was not deleted to make room");
+
+  bool queued = true;
+  for (int i = 0; i < 100; i++) {
+    queued &= request(device, runAction) != nullptr;
+    device.queueEventObject(new ThingEventObject("alarm", true));
+    serializeQueues(device);
+  }
+  expect(queued, "finished actions were not deleted to make room");
+
+  // A handler that just ran an action still holds it
+  device.holdActions();
+  device.tickActions();
+  device.releaseActions();
+  expect(count(device) == ACTION_POOL_SIZE,
+         "finished actions were deleted while held");
+
+  // With WITHOUT_ACTION_HISTORY, update() deletes the finished ones
+  device.tickActions();
+  expect(count(device) == ACTION_POOL_SIZE - 1, "finished actions were kept");
+  expect(cancels == 0, "a finished action was cancelled");
+  expect(allocations == before, "actions or events allocated");
+
+  printf("actions: %d failures\n", failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,118 @@
+/**
+ * pool.cpp
+ *
+ * Leases JSON documents the way a request and update() do at the same time,
+ * and fails if the default WITH_JSON_POOL sizes make any of them fall back
+ * to the heap. Also fails if an exhausted pool does not fall back, if a
+ * released document is not lent again, or if a small request takes a large
+ * document.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <Arduino.h>
+#include "Thing.h"
+
+#include <new>
+
+static long allocations = 0;
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static int failures = 0;
+
+static void expect(bool ok, const char *what) {
+  if (!ok) {
+    printf("pool: %s\n", what);
+    failures++;
+  }
+}
+
+static void handleRequestDuringUpdate() {
+  // update() sending changed properties
+  ThingJsonLease message(LARGE_JSON_DOCUMENT_SIZE);
+  // A WebSocket message requesting an action, which reports its status
+  ThingJsonLease request(SMALL_JSON_DOCUMENT_SIZE);
+  ThingJsonLease action(SMALL_JSON_DOCUMENT_SIZE);
+  ThingJsonLease status(LARGE_JSON_DOCUMENT_SIZE);
+  // Another small one, e.g. the response to a request
+  ThingJsonLease response(SMALL_JSON_DOCUMENT_SIZE);
+}
+
+static void exhaust() {
+  ThingJsonPool pool(2, 1);
+  DynamicJsonDocument *a = pool.acquire(SMALL_JSON_DOCUMENT_SIZE);
+  DynamicJsonDocument *b = pool.acquire(SMALL_JSON_DOCUMENT_SIZE);
+  expect(!pool.isFull(), "the large document was lent for a small request");
+
+  long before = allocations;
+  DynamicJsonDocument *c = pool.acquire(SMALL_JSON_DOCUMENT_SIZE);
+  expect(c != nullptr && c != a && c != b && allocations > before &&
+             pool.fallbacks == 1,
+         "an exhausted pool did not fall back to the heap");
+
+  DynamicJsonDocument *large = pool.acquire(LARGE_JSON_DOCUMENT_SIZE);
+  expect(large != nullptr && pool.fallbacks == 1 && pool.isFull(),
+         "a small request took the large document");
+
+  // The fallback is freed, the others are lent again
+  pool.release(c);
+  pool.release(b);
+  before = allocations;
+  DynamicJsonDocument *again = pool.acquire(SMALL_JSON_DOCUMENT_SIZE);
+  expect(again == b && allocations == before && pool.fallbacks == 1,
+         "a released document was not lent again");
+
+  pool.release(again);
+  pool.release(a);
+  pool.release(large);
+  expect(!pool.isFull(), "released documents are still lent");
+}
+
+static void exhaustFixed() {
+  ThingJsonPool pool(1, 0, false);
+  DynamicJsonDocument *a = pool.acquire(SMALL_JSON_DOCUMENT_SIZE);
+  long before = allocations;
+  expect(pool.acquire(SMALL_JSON_DOCUMENT_SIZE) == nullptr &&
+             allocations == before,
+         "a pool that cannot grow allocated");
+  expect(pool.acquire(LARGE_JSON_DOCUMENT_SIZE) == nullptr,
+         "a pool without large documents lent one");
+  pool.release(a);
+  expect(pool.acquire(SMALL_JSON_DOCUMENT_SIZE) == a,
+         "a pool that cannot grow did not lend a released document");
+}
+
+int main() {
+  // Allocates the pool, as begin() does
+  thingJsonPool();
+  long before = allocations;
+
+  for (int i = 0; i < 100; i++) {
+    handleRequestDuringUpdate();
+  }
+
+  long fallbacks = thingJsonPool().fallbacks;
+  expect(fallbacks == 0, "the default sizes fell back to the heap");
+  expect(allocations == before, "leasing the default pool allocated");
+  printf("pool: %ld fallbacks, %ld allocations\n", fallbacks,
+         allocations - before);
+
+  exhaust();
+  exhaustFixed();
+
+  printf("pool: %d failures\n", failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+/**
+ * serialize.cpp
+ *
+ * Counts the heap allocations made while serializing a thing description
+ * and property values, and the strings copied into the document. Fails if
+ * serializing values or the description of a property, action or event
+ * allocates or copies a string, or if the thing description does more
+ * than its links to the collections need.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <Arduino.h>
+#include "Thing.h"
+
+#include <new>
+
+static long allocations = 0;
+
+void *operator new(size_t size) {
+  allocations++;
+  void *p = malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+/** Number of members and elements in v, each taking one slot of the pool. */
+static size_t countSlots(JsonVariantConst v) {
+  size_t slots = 0;
+  if (v.is<JsonObjectConst>()) {
+    for (JsonPairConst kv : v.as<JsonObjectConst>()) {
+      slots += 1 + countSlots(kv.value());
+    }
+  } else if (v.is<JsonArrayConst>()) {
+    for (JsonVariantConst element : v.as<JsonArrayConst>()) {
+      slots += 1 + countSlots(element);
+    }
+  }
+  return slots;
+}
+
+/**
+ * Whether the document holds nothing but its slots and copied bytes of
+ * strings, which would otherwise be stored as pointers.
+ */
+static bool copiedOnly(const JsonDocument &doc, size_t copied) {
+  return doc.memoryUsage() == JSON_OBJECT_SIZE(countSlots(doc)) + copied;
+}
+
+int main() {
+  const char *types[] = {"Light", nullptr};
+  ThingDevice device("lamp", "Lamp", types);
+  ThingProperty on("on", "Whether the lamp is on", BOOLEAN, "OnOffProperty");
+  ThingProperty level("level", "Brightness", INTEGER, "BrightnessProperty");
+  ThingAction fade("fade", nullptr, nullptr);
+  ThingEvent overheated("overheated", "Too hot", NUMBER, "OverheatedEvent");
+  device.addProperty(&on);
+  device.addProperty(&level);
+  device.addAction(&fade);
+  device.addEvent(&overheated);
+  String ip("10.0.0.2");
+  device.setAddress(ip, 80);
+
+  DynamicJsonDocument doc(LARGE_JSON_DOCUMENT_SIZE);
+  // The links to the collections are the only strings copied
+  size_t linkBytes = (device.href + "/properties").length() + 1 +
+                     (device.href + "/actions").length() + 1 +
+                     (device.href + "/events").length() + 1;
+
+  long before = allocations;
+  JsonObject values = doc.to<JsonObject>();
+  on.serializeValue(values);
+  level.serializeValue(values);
+  long valueAllocations = allocations - before;
+  bool copied = !copiedOnly(doc, 0);
+
+  before = allocations;
+  on.serialize(doc.to<JsonObject>(), device.id, "properties");
+  copied |= !copiedOnly(doc, 0);
+  fade.serialize(doc.to<JsonObject>(), device.id);
+  copied |= !copiedOnly(doc, 0);
+  overheated.serialize(doc.to<JsonObject>(), device.id, "events");
+  copied |= !copiedOnly(doc, 0);
+  long itemAllocations = allocations - before;
+
+  before = allocations;
+  device.serialize(doc.to<JsonObject>(), ip, 80);
+  long descriptionAllocations = allocations - before;
+  copied |= !copiedOnly(doc, linkBytes);
+
+  printf("serialize: %ld allocations for values, %ld for items, %ld for the "
+         "thing description, %s\n",
+         valueAllocations, itemAllocations, descriptionAllocations,
+         copied ? "other strings copied" : "no other strings copied");
+  // One for each of the properties, actions and events links
+  return valueAllocations == 0 && itemAllocations == 0 &&
+                 descriptionAllocations <= 3 && !copied
+             ? 0
+             : 1;
+}
@@ -0,0 +1,126 @@
+/**
+ * values.cpp
+ *
+ * Sets property values from one thread while another reads them, the way
+ * loop() and the AsyncTCP task of an ESP32 do with WITH_THREAD_SAFE_VALUES.
+ * Fails if a reader sees a torn value or if anything is allocated while a
+ * value lock is held, or if a reader of several values sees part of a
+ * commit.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <Arduino.h>
+#include "Thing.h"
+
+#include <atomic>
+#include <new>
+
+static std::atomic<long> lockedAllocations(0);
+
+void *operator new(size_t size) {
+  if (thingTestLockDepth() > 0) {
+    lockedAllocations++;
+  }
+  void *p = malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+static const long WRITES = 200000;
+
+// Long enough not to fit into the small buffer of std::string
+static const char SHORT_TEXT[] = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+static const char LONG_TEXT[] =
+    "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb";
+
+static bool isWhole(const String &s) {
+  return s == "" || s == SHORT_TEXT || s == LONG_TEXT;
+}
+
+int main() {
+  const char *types[] = {nullptr};
+  ThingDevice device("test", "Test", types);
+  ThingProperty number("number", "", INTEGER, nullptr);
+  ThingProperty text("text", "", STRING, nullptr);
+  String textValue;
+  ThingDataValue value;
+  value.string = &textValue;
+  text.setValue(value);
+  // Only ever set together, so that readers must see them equal
+  ThingProperty left("left", "", INTEGER, nullptr);
+  ThingProperty right("right", "", INTEGER, nullptr);
+  device.addProperty(&number);
+  device.addProperty(&text);
+  device.addProperty(&left);
+  device.addProperty(&right);
+
+  std::atomic<bool> reading(false);
+  std::atomic<bool> done(false);
+  long torn = 0;
+  long reads = 0;
+
+  std::thread writer([&] {
+    while (!reading) {
+    }
+    for (long i = 0; i < WRITES; i++) {
+      ThingDataValue n;
+      n.integer = (i & 1) ? -1 : 0;
+      if (i % 4 == 0) {
+        // Staged values are made visible by commitUpdate() instead
+        ThingDataValue pair;
+        pair.integer = i;
+        device.beginUpdate();
+        number.setValue(n);
+        text.setValue((i & 1) ? LONG_TEXT : SHORT_TEXT);
+        left.setValue(pair);
+        right.setValue(pair);
+        device.commitUpdate();
+      } else {
+        number.setValue(n);
+        text.setValue((i & 1) ? LONG_TEXT : SHORT_TEXT);
+      }
+    }
+    done = true;
+  });
+
+  std::thread reader([&] {
+    reading = true;
+    while (!done) {
+      long long n = number.getValue().integer;
+      if (n != 0 && n != -1) {
+        torn++;
+      }
+      if (!isWhole(text.getStringValue())) {
+        torn++;
+      }
+      StaticJsonDocument<512> doc;
+      text.serializeValue(doc.to<JsonObject>());
+      long long l, r;
+      uint32_t seq;
+      do {
+        seq = device.version.beginRead();
+        l = left.getValue().integer;
+        r = right.getValue().integer;
+      } while (!device.version.endRead(seq));
+      if (l != r) {
+        torn++;
+      }
+      reads++;
+    }
+  });
+
+  writer.join();
+  reader.join();
+
+  printf("values: %ld reads, %ld torn, %ld allocations under a lock\n", reads,
+         torn, lockedAllocations.load());
+  return torn == 0 && lockedAllocations == 0 ? 0 : 1;
+}